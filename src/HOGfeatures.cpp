@@ -3,40 +3,154 @@
 
 #include "HOGfeatures.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 
 using namespace std;
 using namespace cv;
 
-CvHOGFeatureParams::CvHOGFeatureParams()
+CvHOGFeatureParams::CvHOGFeatureParams() : storage( FULL )
 {
     maxCatCount = 0;
     name = HOGF_NAME;
     featSize = N_BINS * N_CELLS;
 }
 
-void CvHOGEvaluator::init(const CvFeatureParams *_featureParams, int _maxSampleCount, Size _winSize)
+void CvHOGFeatureParams::init( const CvFeatureParams& fp )
 {
-    CV_Assert( _maxSampleCount > 0);
-    int cols = (_winSize.width + 1) * (_winSize.height + 1);
-    for (int bin = 0; bin < N_BINS; bin++)
+    CvFeatureParams::init( fp );
+    storage = ((const CvHOGFeatureParams&)fp).storage;
+}
+
+void CvHOGFeatureParams::write( FileStorage &fs ) const
+{
+    CvFeatureParams::write( fs );
+    string storageStr = storage == FULL ? CC_HOG_STORAGE_FULL :
+                        storage == GRID ? CC_HOG_STORAGE_GRID : string();
+    CV_Assert( !storageStr.empty() );
+    fs << CC_HOG_STORAGE << storageStr;
+}
+
+bool CvHOGFeatureParams::read( const FileNode &node )
+{
+    if( !CvFeatureParams::read( node ) )
+        return false;
+
+    FileNode rnode = node[CC_HOG_STORAGE];
+    if( rnode.empty() ) // written before the storage mode existed
     {
-        hist.push_back(Mat(_maxSampleCount, cols, CV_32FC1));
+        storage = FULL;
+        return true;
     }
-    normSum.create( (int)_maxSampleCount, cols, CV_32FC1 );
+    if( !rnode.isString() )
+        return false;
+    string storageStr;
+    rnode >> storageStr;
+    storage = !storageStr.compare( CC_HOG_STORAGE_FULL ) ? FULL :
+              !storageStr.compare( CC_HOG_STORAGE_GRID ) ? GRID : -1;
+    return (storage >= 0);
+}
+
+void CvHOGFeatureParams::printDefaults() const
+{
+    CvFeatureParams::printDefaults();
+    cout << "  [-hogStorage <" CC_HOG_STORAGE_FULL << "(default) | "
+            << CC_HOG_STORAGE_GRID << ">]" << endl;
+}
+
+void CvHOGFeatureParams::printAttrs() const
+{
+    CvFeatureParams::printAttrs();
+    string storageStr = storage == FULL ? CC_HOG_STORAGE_FULL :
+                        storage == GRID ? CC_HOG_STORAGE_GRID : string();
+    cout << "hogStorage: " << storageStr << endl;
+}
+
+bool CvHOGFeatureParams::scanAttr( const string prmName, const string val )
+{
+    if ( !CvFeatureParams::scanAttr( prmName, val ) )
+    {
+        if( !prmName.compare("-hogStorage") )
+        {
+            storage = !val.compare( CC_HOG_STORAGE_GRID ) ? GRID :
+                      !val.compare( CC_HOG_STORAGE_FULL ) ? FULL : -1;
+            return storage != -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+void CvHOGEvaluator::init(const CvFeatureParams *_featureParams, int _maxSampleCount, Size _winSize)
+{
+    CV_Assert( _maxSampleCount > 0);
+    gridStep = ((const CvHOGFeatureParams*)_featureParams)->storage == CvHOGFeatureParams::GRID ? HOG_GRID_STEP : 1;
+    gridSize = Size( _winSize.width/gridStep + 1, _winSize.height/gridStep + 1 );
+    int cols = gridSize.width * gridSize.height;
+    hist.create( (int)_maxSampleCount, cols*N_BINS, CV_32FC1 );
+    normSum.create( gridSize.height, gridSize.width, CV_32FC1 );
     CvFeatureEvaluator::init( _featureParams, _maxSampleCount, _winSize );
+    blockNorm.create( (int)_maxSampleCount, numFeatures, CV_32FC1 );
+    packFeatures();
+
+    const int borderType = (int)BORDER_REPLICATE;
+    borderMap.resize( _winSize.width + _winSize.height + 4 );
+    int* xmap = &borderMap[0] + 1;
+    int* ymap = xmap + _winSize.width + 2;
+    for( int x = -1; x < _winSize.width + 1; x++ )
+        xmap[x] = borderInterpolate(x, _winSize.width, borderType);
+    for( int y = -1; y < _winSize.height + 1; y++ )
+        ymap[y] = borderInterpolate(y, _winSize.height, borderType);
+    gradBuf.create( 1, _winSize.width*4 + N_BINS + (_winSize.width + 1)*(N_BINS + 1), CV_32FC1 );
 }
 
 void CvHOGEvaluator::setImage(const Mat &img, uchar clsLabel, int idx)
 {
     CV_DbgAssert( !hist.empty());
     CvFeatureEvaluator::setImage( img, clsLabel, idx );
-    vector<Mat> integralHist;
-    for (int bin = 0; bin < N_BINS; bin++)
+    Mat integralHist(gridSize.height, gridSize.width*N_BINS, hist.type(), hist.ptr<float>((int)idx));
+    integralHistogram(img, integralHist, normSum, (int)N_BINS, gridStep);
+
+    // the block normalization factor is shared by all the N_BINS*N_CELLS components of a feature,
+    // so it is computed once per sample here instead of in every Feature::calc
+    const float* pnormSum = normSum.ptr<float>(0);
+    float* pblockNorm = blockNorm.ptr<float>((int)idx);
+    for( int fi = 0; fi < numFeatures; fi++ )
+        pblockNorm[fi] = fastRects.depth() == CV_16S ?
+            calcHOGNormFactor( pnormSum, fastRects.ptr<short>(fi) ) :
+            calcHOGNormFactor( pnormSum, fastRects.ptr<int>(fi) );
+}
+
+void CvHOGEvaluator::packFeatures()
+{
+    int depth = gridSize.area() <= SHRT_MAX ? CV_16S : CV_32S;
+    fastRects.create( numFeatures, N_CELLS*4, depth );
+    for( int fi = 0; fi < numFeatures; fi++ )
     {
-        integralHist.push_back( Mat(winSize.height + 1, winSize.width + 1, hist[bin].type(), hist[bin].ptr<float>((int)idx)) );
+        int p[N_CELLS*4];
+        features[fi].getOffsets( gridSize.width, gridStep, p );
+        for( int j = 0; j < N_CELLS*4; j++ )
+        {
+            if( depth == CV_16S )
+                fastRects.ptr<short>(fi)[j] = (short)p[j];
+            else
+                fastRects.ptr<int>(fi)[j] = p[j];
+        }
     }
-    Mat integralNorm(winSize.height + 1, winSize.width + 1, normSum.type(), normSum.ptr<float>((int)idx));
-    integralHistogram(img, integralHist, integralNorm, (int)N_BINS);
+}
+
+void CvHOGEvaluator::calcColumn( int varIdx, int sampleCount, float* dst ) const
+{
+    int featureIdx = varIdx / (N_BINS * N_CELLS);
+    int componentIdx = varIdx % (N_BINS * N_CELLS);
+    int binIdx = componentIdx % N_BINS;
+    int cellIdx = componentIdx / N_BINS;
+    // the corners of the cell, as offsets of its bin in the interleaved histogram row
+    int p[4];
+    for( int j = 0; j < 4; j++ )
+        p[j] = (fastRects.depth() == CV_16S ? fastRects.ptr<short>(featureIdx)[cellIdx*4 + j] :
+                fastRects.ptr<int>(featureIdx)[cellIdx*4 + j])*N_BINS + binIdx;
+    getTrainKernels().hogColumn( hist.ptr<float>(0), hist.step1(), blockNorm.ptr<float>(0) + featureIdx,
+                                 blockNorm.step1(), p, sampleCount, dst );
 }
 
 //void CvHOGEvaluator::writeFeatures( FileStorage &fs, const Mat& featureMap ) const
@@ -64,38 +178,28 @@ void CvHOGEvaluator::writeFeatures( FileStorage &fs, const Mat& featureMap ) con
 
 void CvHOGEvaluator::generateFeatures()
 {
-    int offset = winSize.width + 1;
+    // cell shapes t x t, t x 2t and 2t x t, a block is 2 x 2 cells
+    static const int cellScale[][2] = { {1, 1}, {1, 2}, {2, 1} };
     Size blockStep;
     int x, y, t, w, h;
 
-    for (t = 8; t <= winSize.width/2; t+=8) //t = size of a cell. blocksize = 4*cellSize
+    int cellStep = 8*featureParams->sizeStride;
+    for (t = cellStep; t <= winSize.width/2; t+=cellStep) //t = size of a cell. blocksize = 4*cellSize
     {
-        blockStep = Size(4,4);
-        w = 2*t; //width of a block
-        h = 2*t; //height of a block
-        for (x = 0; x <= winSize.width - w; x += blockStep.width)
-        {
-            for (y = 0; y <= winSize.height - h; y += blockStep.height)
-            {
-                features.push_back(Feature(offset, x, y, t, t));
-            }
-        }
-        w = 2*t;
-        h = 4*t;
-        for (x = 0; x <= winSize.width - w; x += blockStep.width)
-        {
-            for (y = 0; y <= winSize.height - h; y += blockStep.height)
-            {
-                features.push_back(Feature(offset, x, y, t, 2*t));
-            }
-        }
-        w = 4*t;
-        h = 2*t;
-        for (x = 0; x <= winSize.width - w; x += blockStep.width)
+        blockStep = Size(4*featureParams->posStride, 4*featureParams->posStride);
+        for (int s = 0; s < 3; s++)
         {
-            for (y = 0; y <= winSize.height - h; y += blockStep.height)
+            int cellW = cellScale[s][0]*t, cellH = cellScale[s][1]*t;
+            if (!featureParams->isCellSizeAllowed(cellW, cellH))
+                continue;
+            w = 2*cellW; //width of a block
+            h = 2*cellH; //height of a block
+            for (x = 0; x <= winSize.width - w; x += blockStep.width)
             {
-                features.push_back(Feature(offset, x, y, 2*t, t));
+                for (y = 0; y <= winSize.height - h; y += blockStep.height)
+                {
+                    features.push_back(Feature(x, y, cellW, cellH));
+                }
             }
         }
     }
@@ -111,16 +215,22 @@ CvHOGEvaluator::Feature::Feature()
     }
 }
 
-CvHOGEvaluator::Feature::Feature( int offset, int x, int y, int cellW, int cellH )
+CvHOGEvaluator::Feature::Feature( int x, int y, int cellW, int cellH )
 {
     rect[0] = Rect(x, y, cellW, cellH); //cell0
     rect[1] = Rect(x+cellW, y, cellW, cellH); //cell1
     rect[2] = Rect(x, y+cellH, cellW, cellH); //cell2
     rect[3] = Rect(x+cellW, y+cellH, cellW, cellH); //cell3
+}
 
-    for (int i = 0; i < N_CELLS; i++)
+void CvHOGEvaluator::Feature::getOffsets( int offset, int step, int* p ) const
+{
+    for (int i = 0; i < N_CELLS; i++, p += 4)
     {
-        CV_SUM_OFFSETS(fastRect[i].p0, fastRect[i].p1, fastRect[i].p2, fastRect[i].p3, rect[i], offset);
+        CV_Assert( rect[i].x % step == 0 && rect[i].y % step == 0 &&
+                   rect[i].width % step == 0 && rect[i].height % step == 0 );
+        Rect gridRect( rect[i].x/step, rect[i].y/step, rect[i].width/step, rect[i].height/step );
+        CV_SUM_OFFSETS(p[0], p[1], p[2], p[3], gridRect, offset);
     }
 }
 
@@ -154,97 +264,76 @@ void CvHOGEvaluator::Feature::write(FileStorage &fs, int featComponentIdx) const
 }
 
 
-void CvHOGEvaluator::integralHistogram(const Mat &img, vector<Mat> &histogram, Mat &norm, int nbins) const
+void CvHOGEvaluator::integralHistogram(const Mat &img, Mat &histogram, Mat &norm, int nbins, int step)
 {
     CV_Assert( img.type() == CV_8U || img.type() == CV_8UC3 );
-    int x, y, binIdx;
+    CV_Assert( img.size() == winSize && nbins <= N_BINS );
+    CV_Assert( step >= 1 && histogram.rows == img.rows/step + 1 && norm.rows == histogram.rows &&
+               histogram.cols == (img.cols/step + 1)*nbins && norm.cols == img.cols/step + 1 );
+    int x, y, b;
+    const CvTrainKernels& kernels = getTrainKernels();
 
     Size gradSize(img.size());
-    Size histSize(histogram[0].size());
-    Mat grad(gradSize, CV_32F);
-    Mat qangle(gradSize, CV_8U);
-
-    AutoBuffer<int> mapbuf(gradSize.width + gradSize.height + 4);
-    int* xmap = (int*)mapbuf + 1;
-    int* ymap = xmap + gradSize.width + 2;
-
-    const int borderType = (int)BORDER_REPLICATE;
+    int width = gradSize.width;
 
-    for( x = -1; x < gradSize.width + 1; x++ )
-        xmap[x] = borderInterpolate(x, gradSize.width, borderType);
-    for( y = -1; y < gradSize.height + 1; y++ )
-        ymap[y] = borderInterpolate(y, gradSize.height, borderType);
+    // border maps and row buffers are prepared in init, no allocation happens per sample
+    const int* xmap = &borderMap[0] + 1;
+    const int* ymap = xmap + gradSize.width + 2;
 
-    int width = gradSize.width;
-    AutoBuffer<float> _dbuf(width*4);
-    float* dbuf = _dbuf;
+    float* dbuf = gradBuf.ptr<float>(0);
     Mat Dx(1, width, CV_32F, dbuf);
     Mat Dy(1, width, CV_32F, dbuf + width);
     Mat Mag(1, width, CV_32F, dbuf + width*2);
     Mat Angle(1, width, CV_32F, dbuf + width*3);
+    float* rowSum = dbuf + width*4; // running per-bin sums of the current row
+    float* accHist = rowSum + nbins; // full resolution integral row, interleaved bins
+    float* accNorm = accHist + (width + 1)*nbins; // full resolution magnitude integral row
 
     float angleScale = (float)(nbins/CV_PI);
 
+    memset( accHist, 0, (width + 1)*nbins*sizeof(accHist[0]) );
+    memset( accNorm, 0, (width + 1)*sizeof(accNorm[0]) );
+    memset( histogram.data, 0, histogram.cols*sizeof(float) );
+    memset( norm.data, 0, norm.cols*sizeof(float) );
+
+    // Single pass over the image: gradients and orientation bins of a row are computed,
+    // then all the bin integrals (interleaved) and the magnitude integral are accumulated
+    // together. Only every step-th integral row and column is kept in the output.
     for( y = 0; y < gradSize.height; y++ )
     {
         const uchar* currPtr = img.data + img.step*ymap[y];
         const uchar* prevPtr = img.data + img.step*ymap[y-1];
         const uchar* nextPtr = img.data + img.step*ymap[y+1];
-        float* gradPtr = (float*)grad.ptr(y);
-        uchar* qanglePtr = (uchar*)qangle.ptr(y);
 
+        dbuf[0] = (float)(currPtr[xmap[1]] - currPtr[xmap[-1]]);
+        for( x = 1; x < width - 1; x++ )
+            dbuf[x] = (float)(currPtr[x+1] - currPtr[x-1]);
+        if( width > 1 )
+            dbuf[width-1] = (float)(currPtr[xmap[width]] - currPtr[xmap[width-2]]);
         for( x = 0; x < width; x++ )
-        {
-            dbuf[x] = (float)(currPtr[xmap[x+1]] - currPtr[xmap[x-1]]);
-            dbuf[width + x] = (float)(nextPtr[xmap[x]] - prevPtr[xmap[x]]);
-        }
+            dbuf[width + x] = (float)(nextPtr[x] - prevPtr[x]);
         cartToPolar( Dx, Dy, Mag, Angle, false );
-        for( x = 0; x < width; x++ )
-        {
-            float mag = dbuf[x+width*2];
-            float angle = dbuf[x+width*3];
-            angle = angle*angleScale - 0.5f;
-            int bidx = cvFloor(angle);
-            angle -= bidx;
-            if( bidx < 0 )
-                bidx += nbins;
-            else if( bidx >= nbins )
-                bidx -= nbins;
-
-            qanglePtr[x] = (uchar)bidx;
-            gradPtr[x] = mag;
-        }
-    }
-    integral(grad, norm, grad.depth());
 
-    float* histBuf;
-    const float* magBuf;
-    const uchar* binsBuf;
+        kernels.hogAccumulateRow( dbuf + width*2, dbuf + width*3, angleScale, width, nbins, rowSum, accHist, accNorm );
 
-    int binsStep = (int)( qangle.step / sizeof(uchar) );
-    int histStep = (int)( histogram[0].step / sizeof(float) );
-    int magStep = (int)( grad.step / sizeof(float) );
-    for( binIdx = 0; binIdx < nbins; binIdx++ )
-    {
-        histBuf = (float*)histogram[binIdx].data;
-        magBuf = (const float*)grad.data;
-        binsBuf = (const uchar*)qangle.data;
-
-        memset( histBuf, 0, histSize.width * sizeof(histBuf[0]) );
-        histBuf += histStep + 1;
-        for( y = 0; y < qangle.rows; y++ )
+        if( (y + 1) % step == 0 )
         {
-            histBuf[-1] = 0.f;
-            float strSum = 0.f;
-            for( x = 0; x < qangle.cols; x++ )
+            float* histBuf = histogram.ptr<float>((y + 1)/step);
+            float* normBuf = norm.ptr<float>((y + 1)/step);
+            if( step == 1 )
+            {
+                memcpy( histBuf, accHist, (width + 1)*nbins*sizeof(histBuf[0]) );
+                memcpy( normBuf, accNorm, (width + 1)*sizeof(normBuf[0]) );
+            }
+            else
             {
-                if( binsBuf[x] == binIdx )
-                    strSum += magBuf[x];
-                histBuf[x] = histBuf[-histStep + x] + strSum;
+                for( x = 0; x <= width; x += step, histBuf += nbins, normBuf++ )
+                {
+                    for( b = 0; b < nbins; b++ )
+                        histBuf[b] = accHist[x*nbins + b];
+                    *normBuf = accNorm[x];
+                }
             }
-            histBuf += histStep;
-            binsBuf += binsStep;
-            magBuf += magStep;
         }
     }
 }
@@ -8,11 +8,26 @@
 
 #define N_BINS 9
 #define N_CELLS 4
+#define HOG_GRID_STEP 4 // all block corners generated by CvHOGEvaluator lie on this lattice
 
 #define HOGF_NAME "HOGFeatureParams"
 struct CvHOGFeatureParams : public CvFeatureParams
 {
+    enum { FULL = 0, GRID = 1 };
+     /* 0 - FULL = integral histograms at every pixel
+     *  1 - GRID = integral histograms on the HOG_GRID_STEP lattice only */
+
     CvHOGFeatureParams();
+
+    virtual void init( const CvFeatureParams& fp );
+    virtual void write( cv::FileStorage &fs ) const;
+    virtual bool read( const cv::FileNode &node );
+
+    virtual void printDefaults() const;
+    virtual void printAttrs() const;
+    virtual bool scanAttr( const std::string prm, const std::string val );
+
+    int storage;
 };
 
 class CvHOGEvaluator : public CvFeatureEvaluator
@@ -23,56 +38,69 @@ public:
         int _maxSampleCount, cv::Size _winSize );
     virtual void setImage(const cv::Mat& img, uchar clsLabel, int idx);
     virtual float operator()(int varIdx, int sampleIdx) const;
+    virtual void calcColumn( int varIdx, int sampleCount, float* dst ) const;
     virtual void writeFeatures( cv::FileStorage &fs, const cv::Mat& featureMap ) const;
 protected:
     virtual void generateFeatures();
-    virtual void integralHistogram(const cv::Mat &img, std::vector<cv::Mat> &histogram, cv::Mat &norm, int nbins) const;
+    virtual void integralHistogram(const cv::Mat &img, cv::Mat &histogram, cv::Mat &norm, int nbins, int step);
+    void packFeatures();
     class Feature
     {
     public:
         Feature();
-        Feature( int offset, int x, int y, int cellW, int cellH );
-        float calc( const std::vector<cv::Mat> &_hists, const cv::Mat &_normSum, size_t y, int featComponent ) const;
+        Feature( int x, int y, int cellW, int cellH );
+        void getOffsets( int offset, int step, int* p ) const;
         void write( cv::FileStorage &fs ) const;
         void write( cv::FileStorage &fs, int varIdx ) const;
 
         cv::Rect rect[N_CELLS]; //cells
-
-        struct
-        {
-            int p0, p1, p2, p3;
-        } fastRect[N_CELLS];
     };
-    std::vector<Feature> features;
+    std::vector<Feature> features; //cells as written to the cascade, not used by operator()
+    cv::Mat fastRects; //4 integral point offsets per cell (each row represents feature), CV_16S if the grid fits
+
+    cv::Mat normSum; //integral of gradient magnitudes of the current image, for nomalization calculation (L1 or L2)
+    cv::Mat blockNorm; //normalization factor of every block (feature) of every sample (each row represents image)
+    cv::Mat hist; //integral histograms of all bins, interleaved: N_BINS values per integral point (each row represents image)
+    int gridStep; //distance in pixels between stored integral points (1 or HOG_GRID_STEP)
+    cv::Size gridSize; //number of stored integral points per row and column
 
-    cv::Mat normSum; //for nomalization calculation (L1 or L2)
-    std::vector<cv::Mat> hist;
+    // setImage scratch, sized once in init and reused for every sample
+    std::vector<int> borderMap; //replicated border indices: (width + 2) for x then (height + 2) for y
+    cv::Mat gradBuf; //one row of Dx, Dy, magnitude, angle, per-bin row sums and integral row accumulators
 };
 
-inline float CvHOGEvaluator::operator()(int varIdx, int sampleIdx) const
+template<typename _Tp>
+inline float calcHOGNormFactor( const float* pnormSum, const _Tp* p )
 {
-    int featureIdx = varIdx / (N_BINS * N_CELLS);
-    int componentIdx = varIdx % (N_BINS * N_CELLS);
-    //return features[featureIdx].calc( hist, sampleIdx, componentIdx);
-    return features[featureIdx].calc( hist, normSum, sampleIdx, componentIdx);
+    //whole block: top-left corner of cell0 to bottom-right corner of cell3
+    return (float)(pnormSum[p[0]] - pnormSum[p[5]] - pnormSum[p[10]] + pnormSum[p[15]]);
 }
 
-inline float CvHOGEvaluator::Feature::calc( const std::vector<cv::Mat>& _hists, const cv::Mat& _normSum, size_t y, int featComponent ) const
+template<typename _Tp>
+inline float calcHOGComponent( const float* phist, const _Tp* p, float normFactor, int featComponent )
 {
-    float normFactor;
     float res;
 
     int binIdx = featComponent % N_BINS;
     int cellIdx = featComponent / N_BINS;
 
-    const float *phist = _hists[binIdx].ptr<float>((int)y);
-    res = phist[fastRect[cellIdx].p0] - phist[fastRect[cellIdx].p1] - phist[fastRect[cellIdx].p2] + phist[fastRect[cellIdx].p3];
-
-    const float *pnormSum = _normSum.ptr<float>((int)y);
-    normFactor = (float)(pnormSum[fastRect[0].p0] - pnormSum[fastRect[1].p1] - pnormSum[fastRect[2].p2] + pnormSum[fastRect[3].p3]);
+    phist += binIdx;
+    p += cellIdx*4;
+    res = phist[p[0]*N_BINS] - phist[p[1]*N_BINS] - phist[p[2]*N_BINS] + phist[p[3]*N_BINS];
     res = (res > 0.001f) ? ( res / (normFactor + 0.001f) ) : 0.f; //for cutting negative values, which apper due to floating precision
 
     return res;
 }
 
+inline float CvHOGEvaluator::operator()(int varIdx, int sampleIdx) const
+{
+    int featureIdx = varIdx / (N_BINS * N_CELLS);
+    int componentIdx = varIdx % (N_BINS * N_CELLS);
+    const float* phist = hist.ptr<float>(sampleIdx);
+    float normFactor = blockNorm.at<float>(sampleIdx, featureIdx);
+    return fastRects.depth() == CV_16S ?
+        calcHOGComponent( phist, fastRects.ptr<short>(featureIdx), normFactor, componentIdx ) :
+        calcHOGComponent( phist, fastRects.ptr<int>(featureIdx), normFactor, componentIdx );
+}
+
 #endif // _OPENCV_HOGFEATURES_H_
@@ -16,7 +16,10 @@ using cv::ParallelLoopBody;
 
 #include "boost.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 #include <queue>
+#include <map>
+#include <algorithm>
 #include "cxmisc.h"
 
 using namespace std;
@@ -154,7 +157,10 @@ static CvMat* cvPreprocessIndexArray( const CvMat* idx_arr, int data_arr_size, b
 
 //----------------------------- CascadeBoostParams -------------------------------------------------
 
-CvCascadeBoostParams::CvCascadeBoostParams() : minHitRate( 0.995F), maxFalseAlarm( 0.5F )
+CvCascadeBoostParams::CvCascadeBoostParams() : minHitRate( 0.995F), maxFalseAlarm( 0.5F ),
+    valCacheType( FLOAT_CACHE ), splitFinder( SORTED_SPLITS ), maxBins( 256 ),
+    gossTopRate( 0.F ), gossOtherRate( 0.1F ), seed( 0 ), featureFraction( 1.F ),
+    reuseSamples( false ), levelGrowth( false )
 {
     boost_type = CvBoost::GENTLE;
     use_surrogates = use_1se_rule = truncate_pruned_tree = false;
@@ -168,6 +174,15 @@ CvCascadeBoostParams::CvCascadeBoostParams( int _boostType,
     boost_type = CvBoost::GENTLE;
     minHitRate = _minHitRate;
     maxFalseAlarm = _maxFalseAlarm;
+    valCacheType = FLOAT_CACHE;
+    splitFinder = SORTED_SPLITS;
+    maxBins = 256;
+    gossTopRate = 0.F;
+    gossOtherRate = 0.1F;
+    seed = 0;
+    featureFraction = 1.F;
+    reuseSamples = false;
+    levelGrowth = false;
     use_surrogates = use_1se_rule = truncate_pruned_tree = false;
 }
 
@@ -184,6 +199,13 @@ void CvCascadeBoostParams::write( FileStorage &fs ) const
     fs << CC_TRIM_RATE << weight_trim_rate;
     fs << CC_MAX_DEPTH << max_depth;
     fs << CC_WEAK_COUNT << weak_count;
+    fs << CC_VAL_CACHE << string( valCacheType == QUANT16_CACHE ? CC_VAL_CACHE_Q16 : CC_VAL_CACHE_FLOAT );
+    fs << CC_SPLIT_FINDER << string( splitFinder == HIST_SPLITS ? CC_SPLIT_HIST : CC_SPLIT_SORTED );
+    fs << CC_MAX_BINS << maxBins;
+    fs << CC_GOSS_TOP_RATE << gossTopRate;
+    fs << CC_GOSS_OTHER_RATE << gossOtherRate;
+    fs << CC_SEED << seed;
+    fs << CC_FEATURE_FRACTION << featureFraction;
 }
 
 //stageĲǷϺ׼ǵĻ洢boost_type(bt),minHitRate,maxFalseAlarm,weight_trim_rate,max_depth,weak_count
@@ -203,10 +225,24 @@ bool CvCascadeBoostParams::read( const FileNode &node )
     node[CC_TRIM_RATE] >> weight_trim_rate ;
     node[CC_MAX_DEPTH] >> max_depth ;
     node[CC_WEAK_COUNT] >> weak_count ;
+    // older params files have no cache type, they were trained with float values
+    string valCacheStr;
+    cv::read( node[CC_VAL_CACHE], valCacheStr, string( CC_VAL_CACHE_FLOAT ) );
+    valCacheType = !valCacheStr.compare( CC_VAL_CACHE_Q16 ) ? QUANT16_CACHE : FLOAT_CACHE;
+    string splitFinderStr;
+    cv::read( node[CC_SPLIT_FINDER], splitFinderStr, string( CC_SPLIT_SORTED ) );
+    splitFinder = !splitFinderStr.compare( CC_SPLIT_HIST ) ? HIST_SPLITS : SORTED_SPLITS;
+    cv::read( node[CC_MAX_BINS], maxBins, 256 );
+    cv::read( node[CC_GOSS_TOP_RATE], gossTopRate, 0.F );
+    cv::read( node[CC_GOSS_OTHER_RATE], gossOtherRate, 0.1F );
+    cv::read( node[CC_SEED], seed, 0 );
+    cv::read( node[CC_FEATURE_FRACTION], featureFraction, 1.F );
     if ( minHitRate <= 0 || minHitRate > 1 ||
          maxFalseAlarm <= 0 || maxFalseAlarm > 1 ||
          weight_trim_rate <= 0 || weight_trim_rate > 1 ||
-         max_depth <= 0 || weak_count <= 0 )
+         max_depth <= 0 || weak_count <= 0 || maxBins < 2 || maxBins > 256 ||
+         gossTopRate < 0 || gossTopRate >= 1 || gossOtherRate <= 0 || gossOtherRate > 1 ||
+         featureFraction <= 0 || featureFraction > 1 )
         CV_Error( CV_StsBadArg, "bad parameters range");
     return true;
 }
@@ -223,6 +259,18 @@ void CvCascadeBoostParams::printDefaults() const
     cout << "  [-weightTrimRate <weight_trim_rate = " << weight_trim_rate << ">]" << endl;
     cout << "  [-maxDepth <max_depth_of_weak_tree = " << max_depth << ">]" << endl;
     cout << "  [-maxWeakCount <max_weak_tree_count = " << weak_count << ">]" << endl;
+    cout << "  [-valCache <{" << CC_VAL_CACHE_FLOAT << "(default), "
+                              << CC_VAL_CACHE_Q16 << "}>]" << endl;
+    cout << "  [-splitFinder <{" << CC_SPLIT_SORTED << "(default), "
+                                 << CC_SPLIT_HIST << "}>]" << endl;
+    cout << "  [-maxBins <max_histogram_bins_per_feature = " << maxBins << ">]" << endl;
+    cout << "  [-gossTopRate <fraction_of_largest_weights_kept_per_tree = " << gossTopRate << " (no sampling)>]" << endl;
+    cout << "  [-gossOtherRate <fraction_of_the_other_samples_drawn_per_tree = " << gossOtherRate << ">]" << endl;
+    cout << "  [-seed <random_seed = " << seed << ">]" << endl;
+    cout << "  [-featureFraction <fraction_of_features_searched_per_tree = " << featureFraction << ">]" << endl;
+    cout << "  [-swapDir <scratch_dir_for_values_past_precalc_buffers>]" << endl;
+    cout << "  [-reuseSamples <reuse_values_of_samples_kept_between_stages = " << reuseSamples << ">]" << endl;
+    cout << "  [-levelGrowth <grow_trees_level_by_level_with_HIST_splits = " << levelGrowth << ">]" << endl;
 }
 
 void CvCascadeBoostParams::printAttrs() const
@@ -238,6 +286,22 @@ void CvCascadeBoostParams::printAttrs() const
     cout << "weightTrimRate: " << weight_trim_rate << endl;
     cout << "maxDepth: " << max_depth << endl;
     cout << "maxWeakCount: " << weak_count << endl;
+    cout << "valCache: " << (valCacheType == QUANT16_CACHE ? CC_VAL_CACHE_Q16 : CC_VAL_CACHE_FLOAT) << endl;
+    cout << "splitFinder: " << (splitFinder == HIST_SPLITS ? CC_SPLIT_HIST : CC_SPLIT_SORTED) << endl;
+    if( splitFinder == HIST_SPLITS )
+        cout << "maxBins: " << maxBins << endl;
+    if( gossTopRate > 0 )
+    {
+        cout << "gossTopRate: " << gossTopRate << endl;
+        cout << "gossOtherRate: " << gossOtherRate << endl;
+    }
+    cout << "seed: " << seed << endl;
+    cout << "featureFraction: " << featureFraction << endl;
+    if( !swapDir.empty() )
+        cout << "swapDir: " << swapDir << endl;
+    cout << "reuseSamples: " << reuseSamples << endl;
+    if( splitFinder == HIST_SPLITS )
+        cout << "levelGrowth: " << levelGrowth << endl;
 }
 
 bool CvCascadeBoostParams::scanAttr( const string prmName, const string val)
@@ -273,6 +337,60 @@ bool CvCascadeBoostParams::scanAttr( const string prmName, const string val)
     {
         weak_count = atoi( val.c_str() );
     }
+    else if( !prmName.compare( "-valCache" ) )
+    {
+        valCacheType = !val.compare( CC_VAL_CACHE_FLOAT ) ? FLOAT_CACHE :
+                       !val.compare( CC_VAL_CACHE_Q16 ) ? QUANT16_CACHE : -1;
+        if (valCacheType == -1)
+            res = false;
+    }
+    else if( !prmName.compare( "-splitFinder" ) )
+    {
+        splitFinder = !val.compare( CC_SPLIT_SORTED ) ? SORTED_SPLITS :
+                      !val.compare( CC_SPLIT_HIST ) ? HIST_SPLITS : -1;
+        if (splitFinder == -1)
+            res = false;
+    }
+    else if( !prmName.compare( "-maxBins" ) )
+    {
+        maxBins = atoi( val.c_str() );
+        if( maxBins < 2 || maxBins > 256 )
+            res = false;
+    }
+    else if( !prmName.compare( "-gossTopRate" ) )
+    {
+        gossTopRate = (float) atof( val.c_str() );
+        if( gossTopRate < 0 || gossTopRate >= 1 )
+            res = false;
+    }
+    else if( !prmName.compare( "-gossOtherRate" ) )
+    {
+        gossOtherRate = (float) atof( val.c_str() );
+        if( gossOtherRate <= 0 || gossOtherRate > 1 )
+            res = false;
+    }
+    else if( !prmName.compare( "-seed" ) )
+    {
+        seed = atoi( val.c_str() );
+    }
+    else if( !prmName.compare( "-featureFraction" ) )
+    {
+        featureFraction = (float) atof( val.c_str() );
+        if( featureFraction <= 0 || featureFraction > 1 )
+            res = false;
+    }
+    else if( !prmName.compare( "-swapDir" ) )
+    {
+        swapDir = val;
+    }
+    else if( !prmName.compare( "-reuseSamples" ) )
+    {
+        reuseSamples = atoi( val.c_str() ) != 0;
+    }
+    else if( !prmName.compare( "-levelGrowth" ) )
+    {
+        levelGrowth = atoi( val.c_str() ) != 0;
+    }
     else
         res = false;
 
@@ -289,6 +407,7 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
 
     if( !data_root )
         CV_Error( CV_StsError, "No training data has been set" );
+    viewRoot = 0;
 
     if( _subsample_idx )
     {
@@ -354,9 +473,22 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
                 co[i*2+1] = -1;
         }
 
+        // a subset without repeated samples is a view of the sorted indices of data_root,
+        // they are filtered when the root data is read instead of being copied here
+        bool isView = numPrecalcIdx > 0;
+        for( int i = 0; i < sample_count && isView; i++ )
+            isView = co[i*2] <= 1;
+        if( isView )
+        {
+            viewIdx.resize( sample_count );
+            for( int i = 0; i < sample_count; i++ )
+                viewIdx[i] = co[i*2] ? co[i*2+1] : -1;
+            viewRoot = root;
+        }
+
         cv::AutoBuffer<uchar> inn_buf(sample_count*(2*sizeof(int) + sizeof(float)));
         // subsample ordered variables
-        for( int vi = 0; vi < numPrecalcIdx; vi++ )
+        for( int vi = 0; vi < (isView ? 0 : numPrecalcIdx); vi++ )
         {
             int ci = get_var_type(vi);
             CV_Assert( ci < 0 );
@@ -375,7 +507,7 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
             if (is_buf_16u)
             {
                 unsigned short* udst_idx = (unsigned short*)(buf->data.s + root->buf_idx*get_length_subbuf() +
-                    vi*sample_count + data_root->offset);
+                    (size_t)vi*sample_count + data_root->offset);
                 for( int i = 0; i < num_valid; i++ )
                 {
                     idx = src_idx[i];
@@ -388,7 +520,7 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
             else
             {
                 int* idst_idx = buf->data.i + root->buf_idx*get_length_subbuf() +
-                    vi*sample_count + root->offset;
+                    (size_t)vi*sample_count + root->offset;
                 for( int i = 0; i < num_valid; i++ )
                 {
                     idx = src_idx[i];
@@ -405,14 +537,14 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
         if (is_buf_16u)
         {
             unsigned short* udst = (unsigned short*)(buf->data.s + root->buf_idx*get_length_subbuf() +
-                (workVarCount-1)*sample_count + root->offset);
+                (size_t)(workVarCount-1)*sample_count + root->offset);
             for( int i = 0; i < count; i++ )
                 udst[i] = (unsigned short)src_lbls[sidx[i]];
         }
         else
         {
             int* idst = buf->data.i + root->buf_idx*get_length_subbuf() +
-                (workVarCount-1)*sample_count + root->offset;
+                (size_t)(workVarCount-1)*sample_count + root->offset;
             for( int i = 0; i < count; i++ )
                 idst[i] = src_lbls[sidx[i]];
         }
@@ -422,14 +554,14 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
         if (is_buf_16u)
         {
             unsigned short* sample_idx_dst = (unsigned short*)(buf->data.s + root->buf_idx*get_length_subbuf() +
-                workVarCount*sample_count + root->offset);
+                (size_t)workVarCount*sample_count + root->offset);
             for( int i = 0; i < count; i++ )
                 sample_idx_dst[i] = (unsigned short)sample_idx_src[sidx[i]];
         }
         else
         {
             int* sample_idx_dst = buf->data.i + root->buf_idx*get_length_subbuf() +
-                workVarCount*sample_count + root->offset;
+                (size_t)workVarCount*sample_count + root->offset;
             for( int i = 0; i < count; i++ )
                 sample_idx_dst[i] = sample_idx_src[sidx[i]];
         }
@@ -447,12 +579,16 @@ CvDTreeNode* CvCascadeBoostTrainData::subsample_data( const CvMat* _subsample_id
 //---------------------------- CascadeBoostTrainData -----------------------------
 
 CvCascadeBoostTrainData::CvCascadeBoostTrainData( const CvFeatureEvaluator* _featureEvaluator,
-                                                  const CvDTreeParams& _params )
+                                                  const CvCascadeBoostParams& _params )
 {
     is_classifier = true;
     var_all = var_count = (int)_featureEvaluator->getNumFeatures();
 
     featureEvaluator = _featureEvaluator;
+    sampleCache = 0;
+    histBufSize = 0;
+    levelGrowth = false;
+    viewRoot = 0;
     shared = true;
     set_params( _params );
     max_c_count = MAX( 2, featureEvaluator->getMaxCatCount() );
@@ -490,15 +626,17 @@ CvCascadeBoostTrainData::CvCascadeBoostTrainData( const CvFeatureEvaluator* _fea
 CvCascadeBoostTrainData::CvCascadeBoostTrainData( const CvFeatureEvaluator* _featureEvaluator,
                                                  int _numSamples,
                                                  int _precalcValBufSize, int _precalcIdxBufSize,
-                                                 const CvDTreeParams& _params )
+                                                 const CvCascadeBoostParams& _params,
+                                                 CvCascadeSampleCache* _sampleCache )
 {
-    setData( _featureEvaluator, _numSamples, _precalcValBufSize, _precalcIdxBufSize, _params );
+    setData( _featureEvaluator, _numSamples, _precalcValBufSize, _precalcIdxBufSize, _params, _sampleCache );
 }
 
 void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluator,
                                       int _numSamples,
                                       int _precalcValBufSize, int _precalcIdxBufSize,
-                                      const CvDTreeParams& _params )
+                                      const CvCascadeBoostParams& _params,
+                                      CvCascadeSampleCache* _sampleCache )
 {
     int* idst = 0;
     unsigned short* udst = 0;
@@ -519,6 +657,9 @@ void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluat
 
     CV_Assert( _featureEvaluator );
     featureEvaluator = _featureEvaluator;
+    sampleCache = _sampleCache;
+    CV_Assert( !sampleCache || (int)sampleCache->ids.size() >= _numSamples );
+    viewRoot = 0;
 
     max_c_count = MAX( 2, featureEvaluator->getMaxCatCount() );
     _resp = featureEvaluator->getCls();
@@ -535,13 +676,45 @@ void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluat
     if (sample_count < 65536)
         is_buf_16u = true;
 
-    numPrecalcVal = min( cvRound((double)_precalcValBufSize*1048576. / (sizeof(float)*sample_count)), var_count );
+    // quantized values take half the memory, so twice as many features are cached;
+    // categorical codes below 256 are kept exactly in a byte
+    int valCacheDepth = featureEvaluator->getMaxCatCount() > 0 && featureEvaluator->getMaxCatCount() <= 256 ? CV_8U :
+                        _params.valCacheType == CvCascadeBoostParams::QUANT16_CACHE ? CV_16U : CV_32F;
+    numPrecalcVal = min( cvRound((double)_precalcValBufSize*1048576. / (CV_ELEM_SIZE(valCacheDepth)*sample_count)), var_count );
     numPrecalcIdx = min( cvRound((double)_precalcIdxBufSize*1048576. /
                 ((is_buf_16u ? sizeof(unsigned short) : sizeof (int))*sample_count)), var_count );
 
     assert( numPrecalcIdx >= 0 && numPrecalcVal >= 0 );
 
-    valCache.create( numPrecalcVal, sample_count, CV_32FC1 );
+    // histogram splits need no sorted indices, their budget holds the node histograms instead
+    bool isHist = _params.splitFinder == CvCascadeBoostParams::HIST_SPLITS && featureEvaluator->getMaxCatCount() == 0;
+    histBufSize = isHist ? (size_t)_precalcIdxBufSize*1048576 : 0;
+    levelGrowth = isHist && _params.levelGrowth;
+    if( isHist )
+        numPrecalcIdx = 0;
+
+    valCache.create( numPrecalcVal, sample_count, valCacheDepth );
+    // the remaining values go to the mapped scratch file instead of being recomputed at every node
+    swapValCache.release();
+    valSwap.release();
+    bufSwap.release();
+    binCodes.release();
+    binThresholds.release();
+    binCounts.clear();
+    binSwap.release();
+    if( !_params.swapDir.empty() && numPrecalcVal < var_count )
+    {
+        int numSwapVal = var_count - numPrecalcVal;
+        void* swapData = valSwap.create( _params.swapDir,
+            (size_t)numSwapVal*sample_count*CV_ELEM_SIZE(valCacheDepth) );
+        if( !swapData )
+            CV_Error( CV_StsError, "Cannot map a scratch file in " + _params.swapDir );
+        swapValCache = Mat( numSwapVal, sample_count, valCacheDepth, swapData );
+        numPrecalcVal = var_count;
+    }
+    valScale.assign( valCacheDepth == CV_16U ? numPrecalcVal : 0, 0.f );
+    valShift.assign( valScale.size(), 0.f );
+    quantError.assign( valScale.size(), 0.f );
     var_type = cvCreateMat( 1, var_count + 2, CV_32SC1 );
 
     if ( featureEvaluator->getMaxCatCount() > 0 )
@@ -565,6 +738,9 @@ void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluat
     }
     var_type->data.i[var_count] = cat_var_count;
     var_type->data.i[var_count+1] = cat_var_count+1;
+    bool isBufMapped = !_params.swapDir.empty() && !cat_var_count && !isHist && numPrecalcIdx < var_count;
+    if( isBufMapped )
+        numPrecalcIdx = var_count;
     work_var_count = ( cat_var_count ? 0 : numPrecalcIdx ) + 1/*cv_lables*/;
     buf_count = 2;
 
@@ -584,15 +760,28 @@ void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluat
         CV_Error(CV_StsBadArg, "The memory buffer cannot be allocated since its size exceeds integer fields limit");
     }
 
-    if ( is_buf_16u )
+    if( isBufMapped )
+    {
+        // sorted indices of all features, the page cache keeps the hot part in memory
+        buf = cvCreateMatHeader( effective_buf_height, effective_buf_width, is_buf_16u ? CV_16UC1 : CV_32SC1 );
+        void* bufData = bufSwap.create( _params.swapDir, effective_buf_size*CV_ELEM_SIZE(buf->type) );
+        if( !bufData )
+            CV_Error( CV_StsError, "Cannot map a scratch file in " + _params.swapDir );
+        cvSetData( buf, bufData, CV_AUTOSTEP );
+    }
+    else if ( is_buf_16u )
         buf = cvCreateMat( effective_buf_height, effective_buf_width, CV_16UC1 );
     else
         buf = cvCreateMat( effective_buf_height, effective_buf_width, CV_32SC1 );
+    if( valSwap.size() || bufSwap.size() )
+        cout << "Scratch files: " << (valSwap.size() + bufSwap.size()) / 1048576 << " Mb in " << _params.swapDir << endl;
 
     cat_count = cvCreateMat( 1, cat_var_count + 1, CV_32SC1 );
 
     // precalculate valCache and set indices in buf
     precalculate();
+    if( isHist )
+        quantizeFeatures( _params.maxBins, _params.swapDir );
 
     // now calculate the maximum size of split,
     // create memory storage that will keep nodes and splits of the decision tree
@@ -615,9 +804,9 @@ void CvCascadeBoostTrainData::setData( const CvFeatureEvaluator* _featureEvaluat
 
     // set sample labels
     if (is_buf_16u)
-        udst = (unsigned short*)(buf->data.s + work_var_count*sample_count);
+        udst = (unsigned short*)(buf->data.s + (size_t)work_var_count*sample_count);
     else
-        idst = buf->data.i + work_var_count*sample_count;
+        idst = buf->data.i + (size_t)work_var_count*sample_count;
 
     for (int si = 0; si < sample_count; si++)
     {
@@ -649,6 +838,58 @@ void CvCascadeBoostTrainData::free_train_data()
 {
     CvDTreeTrainData::free_train_data();
     valCache.release();
+    valScale.clear();
+    valShift.clear();
+    quantError.clear();
+    swapValCache.release();
+    valSwap.release();
+    bufSwap.release();
+    binCodes.release();
+    binThresholds.release();
+    binCounts.clear();
+    binSwap.release();
+    viewRoot = 0;
+    viewIdx.clear();
+}
+
+void CvCascadeBoostTrainData::setCachedRow( int vi, const float* vals )
+{
+    if( valCache.depth() == CV_8U )
+    {
+        uchar* codes = cachedRow( vi );
+        for( int si = 0; si < sample_count; si++ )
+        {
+            CV_DbgAssert( vals[si] >= 0 && vals[si] < 256 );
+            codes[si] = (uchar)cvRound( vals[si] );
+        }
+        return;
+    }
+    if( valCache.depth() != CV_16U )
+    {
+        memcpy( cachedRow( vi ), vals, sample_count*sizeof(float) );
+        return;
+    }
+
+    // affine quantization over the value range of the feature, the code order
+    // follows the value order so the sorted indices stay valid
+    float minVal = vals[0], maxVal = vals[0];
+    for( int si = 1; si < sample_count; si++ )
+    {
+        minVal = min( minVal, vals[si] );
+        maxVal = max( maxVal, vals[si] );
+    }
+    float scale = (maxVal - minVal)/65535.f;
+    double invScale = scale > 0 ? 1./scale : 0.;
+    ushort* codes = (ushort*)cachedRow( vi );
+    float err = 0.f;
+    for( int si = 0; si < sample_count; si++ )
+    {
+        codes[si] = cv::saturate_cast<ushort>( (vals[si] - minVal)*invScale );
+        err = max( err, (float)fabs( minVal + scale*codes[si] - vals[si] ) );
+    }
+    valScale[vi] = scale;
+    valShift[vi] = minVal;
+    quantError[vi] = err;
 }
 
 const int* CvCascadeBoostTrainData::get_class_labels( CvDTreeNode* n, int* labelsBuf)
@@ -684,15 +925,11 @@ void CvCascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* o
 
     if ( vi < numPrecalcIdx )
     {
-        if( !is_buf_16u )
-            *sortedIndices = buf->data.i + n->buf_idx*get_length_subbuf() + vi*sample_count + n->offset;
+        if( !is_buf_16u && n != viewRoot )
+            *sortedIndices = buf->data.i + n->buf_idx*get_length_subbuf() + (size_t)vi*sample_count + n->offset;
         else
         {
-            const unsigned short* shortIndices = (const unsigned short*)(buf->data.s + n->buf_idx*get_length_subbuf() +
-                                                    vi*sample_count + n->offset );
-            for( int i = 0; i < nodeSampleCount; i++ )
-                sortedIndicesBuf[i] = shortIndices[i];
-
+            copySortedIdx( n, vi, sortedIndicesBuf );
             *sortedIndices = sortedIndicesBuf;
         }
 
@@ -702,7 +939,7 @@ void CvCascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* o
             {
                 int idx = (*sortedIndices)[i];
                 idx = sampleIndices[idx];
-                ordValuesBuf[i] =  valCache.at<float>( vi, idx);
+                ordValuesBuf[i] = getCachedVal( vi, idx );
             }
         }
         else
@@ -725,7 +962,7 @@ void CvCascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* o
             for( int i = 0; i < nodeSampleCount; i++ )
             {
                 sortedIndicesBuf[i] = i;
-                sampleValues[i] = valCache.at<float>( vi, sampleIndices[i] );
+                sampleValues[i] = getCachedVal( vi, sampleIndices[i] );
             }
         }
         else
@@ -745,16 +982,57 @@ void CvCascadeBoostTrainData::get_ord_var_data( CvDTreeNode* n, int vi, float* o
     *ordValues = ordValuesBuf;
 }
 
+void CvCascadeBoostTrainData::copySortedIdx( CvDTreeNode* n, int vi, int* dst )
+{
+    if( n == viewRoot )
+    {
+        // the sorted order of all the samples in buffer 0, restricted to the subset
+        const int* pos = &viewIdx[0];
+        int k = 0;
+        if( is_buf_16u )
+        {
+            const unsigned short* src = (const unsigned short*)buf->data.s + (size_t)vi*sample_count;
+            for( int i = 0; i < sample_count; i++ )
+                if( pos[src[i]] >= 0 )
+                    dst[k++] = pos[src[i]];
+        }
+        else
+        {
+            const int* src = buf->data.i + (size_t)vi*sample_count;
+            for( int i = 0; i < sample_count; i++ )
+                if( pos[src[i]] >= 0 )
+                    dst[k++] = pos[src[i]];
+        }
+        CV_Assert( k == n->sample_count );
+    }
+    else if( is_buf_16u )
+    {
+        const unsigned short* src = (const unsigned short*)(buf->data.s + n->buf_idx*get_length_subbuf() +
+                                                           (size_t)vi*sample_count + n->offset);
+        for( int i = 0; i < n->sample_count; i++ )
+            dst[i] = src[i];
+    }
+    else
+        memcpy( dst, buf->data.i + n->buf_idx*get_length_subbuf() + (size_t)vi*sample_count + n->offset,
+                n->sample_count*sizeof(int) );
+}
+
 const int* CvCascadeBoostTrainData::get_cat_var_data( CvDTreeNode* n, int vi, int* catValuesBuf )
 {
     int nodeSampleCount = n->sample_count;
     int* sampleIndicesBuf = catValuesBuf; //
     const int* sampleIndices = get_sample_indices(n, sampleIndicesBuf);
 
-    if ( vi < numPrecalcVal )
+    if ( vi < numPrecalcVal && valCache.depth() == CV_8U )
+    {
+        const uchar* codes = cachedRow( vi );
+        for( int i = 0; i < nodeSampleCount; i++ )
+            catValuesBuf[i] = codes[sampleIndices[i]];
+    }
+    else if ( vi < numPrecalcVal )
     {
         for( int i = 0; i < nodeSampleCount; i++ )
-            catValuesBuf[i] = (int) valCache.at<float>( vi, sampleIndices[i]);
+            catValuesBuf[i] = (int) getCachedVal( vi, sampleIndices[i] );
     }
     else
     {
@@ -774,8 +1052,8 @@ const int* CvCascadeBoostTrainData::get_cat_var_data( CvDTreeNode* n, int vi, in
 
 float CvCascadeBoostTrainData::getVarValue( int vi, int si )
 {
-    if ( vi < numPrecalcVal && !valCache.empty() )
-        return valCache.at<float>( vi, si );
+    if ( vi < numPrecalcVal && (!valCache.empty() || !swapValCache.empty()) )
+        return getCachedVal( vi, si );
     return (*featureEvaluator)( vi, si );
 }
 
@@ -796,18 +1074,18 @@ struct FeatureIdxOnlyPrecalc : ParallelLoopBody
         float* valCachePtr = (float*)valCache;
         for ( int fi = range.start; fi < range.end; fi++)
         {
+            featureEvaluator->calcColumn( fi, sample_count, valCachePtr );
             for( int si = 0; si < sample_count; si++ )
             {
-                valCachePtr[si] = (*featureEvaluator)( fi, si );
                 if ( is_buf_16u )
-                    *(udst + fi*sample_count + si) = (unsigned short)si;
+                    *(udst + (size_t)fi*sample_count + si) = (unsigned short)si;
                 else
-                    *(idst + fi*sample_count + si) = si;
+                    *(idst + (size_t)fi*sample_count + si) = si;
             }
             if ( is_buf_16u )
-                icvSortUShAux( udst + fi*sample_count, sample_count, valCachePtr );
+                icvSortUShAux( udst + (size_t)fi*sample_count, sample_count, valCachePtr );
             else
-                icvSortIntAux( idst + fi*sample_count, sample_count, valCachePtr );
+                icvSortIntAux( idst + (size_t)fi*sample_count, sample_count, valCachePtr );
         }
     }
     const CvFeatureEvaluator* featureEvaluator;
@@ -819,10 +1097,10 @@ struct FeatureIdxOnlyPrecalc : ParallelLoopBody
 
 struct FeatureValAndIdxPrecalc : ParallelLoopBody
 {
-    FeatureValAndIdxPrecalc( const CvFeatureEvaluator* _featureEvaluator, CvMat* _buf, Mat* _valCache, int _sample_count, bool _is_buf_16u )
+    FeatureValAndIdxPrecalc( const CvFeatureEvaluator* _featureEvaluator, CvMat* _buf, CvCascadeBoostTrainData* _data, int _sample_count, bool _is_buf_16u )
     {
         featureEvaluator = _featureEvaluator;
-        valCache = _valCache;
+        data = _data;
         sample_count = _sample_count;
         udst = (unsigned short*)_buf->data.s;
         idst = _buf->data.i;
@@ -830,24 +1108,28 @@ struct FeatureValAndIdxPrecalc : ParallelLoopBody
     }
     void operator()( const Range& range ) const
     {
+        cv::AutoBuffer<float> valBuf(sample_count);
+        float* vals = (float*)valBuf;
         for ( int fi = range.start; fi < range.end; fi++)
         {
+            featureEvaluator->calcColumn( fi, sample_count, vals );
             for( int si = 0; si < sample_count; si++ )
             {
-                valCache->at<float>(fi,si) = (*featureEvaluator)( fi, si );
                 if ( is_buf_16u )
-                    *(udst + fi*sample_count + si) = (unsigned short)si;
+                    *(udst + (size_t)fi*sample_count + si) = (unsigned short)si;
                 else
-                    *(idst + fi*sample_count + si) = si;
+                    *(idst + (size_t)fi*sample_count + si) = si;
             }
+            // sorted by the exact values, the cached ones may be quantized
             if ( is_buf_16u )
-                icvSortUShAux( udst + fi*sample_count, sample_count, valCache->ptr<float>(fi) );
+                icvSortUShAux( udst + (size_t)fi*sample_count, sample_count, vals );
             else
-                icvSortIntAux( idst + fi*sample_count, sample_count, valCache->ptr<float>(fi) );
+                icvSortIntAux( idst + (size_t)fi*sample_count, sample_count, vals );
+            data->setCachedRow( fi, vals );
         }
     }
     const CvFeatureEvaluator* featureEvaluator;
-    Mat* valCache;
+    CvCascadeBoostTrainData* data;
     int sample_count;
     int* idst;
     unsigned short* udst;
@@ -856,51 +1138,308 @@ struct FeatureValAndIdxPrecalc : ParallelLoopBody
 
 struct FeatureValOnlyPrecalc : ParallelLoopBody
 {
-    FeatureValOnlyPrecalc( const CvFeatureEvaluator* _featureEvaluator, Mat* _valCache, int _sample_count )
+    FeatureValOnlyPrecalc( const CvFeatureEvaluator* _featureEvaluator, CvCascadeBoostTrainData* _data, int _sample_count )
+    {
+        featureEvaluator = _featureEvaluator;
+        data = _data;
+        sample_count = _sample_count;
+    }
+    void operator()( const Range& range ) const
+    {
+        cv::AutoBuffer<float> valBuf(sample_count);
+        float* vals = (float*)valBuf;
+        for ( int fi = range.start; fi < range.end; fi++)
+        {
+            featureEvaluator->calcColumn( fi, sample_count, vals );
+            data->setCachedRow( fi, vals );
+        }
+    }
+    const CvFeatureEvaluator* featureEvaluator;
+    CvCascadeBoostTrainData* data;
+    int sample_count;
+};
+
+// Values of samples carried over from the previous stage are copied from its cache,
+// only the new samples are evaluated. The carried samples keep their previous sorted
+// order, the new ones are sorted and merged in.
+struct FeatureReusePrecalc : ParallelLoopBody
+{
+    FeatureReusePrecalc( const CvFeatureEvaluator* _featureEvaluator, CvMat* _buf, CvCascadeBoostTrainData* _data,
+                         const int* _oldIdx, const int* _newIdx, int _numPrecalcIdx, int _sample_count, bool _is_buf_16u )
     {
         featureEvaluator = _featureEvaluator;
-        valCache = _valCache;
+        data = _data;
+        oldIdx = _oldIdx;
+        newIdx = _newIdx;
+        numPrecalcIdx = _numPrecalcIdx;
         sample_count = _sample_count;
+        udst = (unsigned short*)_buf->data.s;
+        idst = _buf->data.i;
+        is_buf_16u = _is_buf_16u;
     }
     void operator()( const Range& range ) const
     {
+        const CvCascadeSampleCache* cache = data->sampleCache;
+        int oldCount = cache->values.cols;
+        cv::AutoBuffer<float> valBuf(sample_count);
+        cv::AutoBuffer<int> idxBuf(sample_count*2);
+        float* vals = (float*)valBuf;
+        int* carried = (int*)idxBuf;
+        int* added = carried + sample_count;
         for ( int fi = range.start; fi < range.end; fi++)
+        {
+            const uchar* cached = cache->values.ptr(fi);
+            int numAdded = 0;
             for( int si = 0; si < sample_count; si++ )
-                valCache->at<float>(fi,si) = (*featureEvaluator)( fi, si );
+            {
+                int oi = oldIdx[si];
+                if( oi < 0 )
+                {
+                    vals[si] = (*featureEvaluator)( fi, si );
+                    added[numAdded++] = si;
+                }
+                else
+                    vals[si] = cache->values.depth() == CV_8U ? (float)cached[oi] : ((const float*)cached)[oi];
+            }
+
+            if( fi < numPrecalcIdx )
+            {
+                int numCarried = 0;
+                const int* sorted = cache->sortedIdx.ptr<int>(fi);
+                for( int i = 0; i < oldCount; i++ )
+                {
+                    int si = newIdx[sorted[i]];
+                    if( si >= 0 )
+                        carried[numCarried++] = si;
+                }
+                icvSortIntAux( added, numAdded, vals );
+
+                int i = 0, j = 0, k = 0;
+                int* irow = idst + (size_t)fi*sample_count;
+                unsigned short* urow = udst + (size_t)fi*sample_count;
+                while( i < numCarried || j < numAdded )
+                {
+                    int si = j >= numAdded || (i < numCarried && !(vals[added[j]] < vals[carried[i]])) ?
+                        carried[i++] : added[j++];
+                    if ( is_buf_16u )
+                        urow[k++] = (unsigned short)si;
+                    else
+                        irow[k++] = si;
+                }
+            }
+            data->setCachedRow( fi, vals );
+        }
     }
     const CvFeatureEvaluator* featureEvaluator;
-    Mat* valCache;
+    CvCascadeBoostTrainData* data;
+    const int* oldIdx;
+    const int* newIdx;
+    int numPrecalcIdx;
     int sample_count;
+    int* idst;
+    unsigned short* udst;
+    bool is_buf_16u;
 };
 
+void CvCascadeSampleCache::clear()
+{
+    cachedIds.clear();
+    values.release();
+    sortedIdx.release();
+}
+
 void CvCascadeBoostTrainData::precalculate()
 {
     int minNum = MIN( numPrecalcVal, numPrecalcIdx);
+    int numReused = 0, reusedSamples = 0;
+    vector<int> oldIdx, newIdx;
+
+    // the cached values are only usable if they were stored the same way
+    if( sampleCache && !sampleCache->values.empty() &&
+        sampleCache->values.depth() == valCache.depth() && valCache.depth() != CV_16U &&
+        (int)sampleCache->cachedIds.size() == sampleCache->values.cols &&
+        (sampleCache->sortedIdx.empty() || sampleCache->sortedIdx.cols == sampleCache->values.cols) )
+    {
+        map<int64, int> oldByIds;
+        for( int oi = 0; oi < (int)sampleCache->cachedIds.size(); oi++ )
+            oldByIds[sampleCache->cachedIds[oi]] = oi;
+        oldIdx.assign( sample_count, -1 );
+        newIdx.assign( sampleCache->cachedIds.size(), -1 );
+        for( int si = 0; si < sample_count; si++ )
+        {
+            map<int64, int>::const_iterator it = oldByIds.find( sampleCache->ids[si] );
+            if( it != oldByIds.end() )
+            {
+                oldIdx[si] = it->second;
+                newIdx[it->second] = si;
+                reusedSamples++;
+            }
+        }
+        numReused = MIN( valCache.rows, sampleCache->values.rows );
+        // presorted features need the sorted order of the previous stage too
+        if( sampleCache->sortedIdx.rows < MIN( numReused, numPrecalcIdx ) )
+            numReused = sampleCache->sortedIdx.rows;
+        if( !reusedSamples )
+            numReused = 0;
+    }
 
     double proctime = -TIME( 0 );
+    parallel_for_( Range(0, numReused),
+                   FeatureReusePrecalc(featureEvaluator, buf, this, numReused ? &oldIdx[0] : 0,
+                                       numReused ? &newIdx[0] : 0, numPrecalcIdx, sample_count, is_buf_16u!=0) );
     parallel_for_( Range(numPrecalcVal, numPrecalcIdx),
                    FeatureIdxOnlyPrecalc(featureEvaluator, buf, sample_count, is_buf_16u!=0) );
-    parallel_for_( Range(0, minNum),
-                   FeatureValAndIdxPrecalc(featureEvaluator, buf, &valCache, sample_count, is_buf_16u!=0) );
-    parallel_for_( Range(minNum, numPrecalcVal),
-                   FeatureValOnlyPrecalc(featureEvaluator, &valCache, sample_count) );
+    parallel_for_( Range(numReused, max(numReused, minNum)),
+                   FeatureValAndIdxPrecalc(featureEvaluator, buf, this, sample_count, is_buf_16u!=0) );
+    parallel_for_( Range(max(numReused, minNum), numPrecalcVal),
+                   FeatureValOnlyPrecalc(featureEvaluator, this, sample_count) );
     cout << "Precalculation time: " << (proctime + TIME( 0 )) << endl;
+    if( numReused )
+        cout << "Reused values of " << reusedSamples << " samples for " << numReused << " features" << endl;
+    // the previous stage is not needed anymore, saveSampleCache fills it again
+    if( sampleCache )
+        sampleCache->clear();
+    if( !quantError.empty() )
+    {
+        double errSum = 0, errMax = 0;
+        for( size_t fi = 0; fi < quantError.size(); fi++ )
+        {
+            errSum += quantError[fi];
+            errMax = max( errMax, (double)quantError[fi] );
+        }
+        cout << "Quantized value cache: " << numPrecalcVal << " features, max error " << errMax
+             << ", mean max error per feature " << errSum/quantError.size() << endl;
+    }
+}
+
+// Keeps the in-memory values and the root sorted indices for the next stage,
+// called before free_train_data.
+void CvCascadeBoostTrainData::saveSampleCache()
+{
+    if( !sampleCache )
+        return;
+    sampleCache->clear();
+    // quantization ranges change with the samples, such values are not carried over
+    if( valCache.empty() || valCache.depth() == CV_16U )
+        return;
+    sampleCache->cachedIds.assign( sampleCache->ids.begin(), sampleCache->ids.begin() + sample_count );
+    sampleCache->values = valCache;
+
+    // the root node data stays in buffer 0 while the trees are grown
+    int numSorted = MIN( numPrecalcIdx, valCache.rows );
+    if( numSorted > 0 )
+    {
+        sampleCache->sortedIdx.create( numSorted, sample_count, CV_32SC1 );
+        for( int vi = 0; vi < numSorted; vi++ )
+        {
+            int* dst = sampleCache->sortedIdx.ptr<int>(vi);
+            if( is_buf_16u )
+            {
+                const unsigned short* src = (const unsigned short*)buf->data.s + (size_t)vi*sample_count;
+                for( int i = 0; i < sample_count; i++ )
+                    dst[i] = src[i];
+            }
+            else
+                memcpy( dst, buf->data.i + (size_t)vi*sample_count, sample_count*sizeof(int) );
+        }
+    }
+}
+
+// Splits the sorted values of every feature into at most maxBins bins of close to equal
+// sample counts. Values closer than the split epsilon of the sorted search stay in one bin,
+// so a threshold between two bins separates the training samples the same way as their codes.
+struct FeatureQuantizer : ParallelLoopBody
+{
+    FeatureQuantizer( const CvFeatureEvaluator* _featureEvaluator, CvCascadeBoostTrainData* _data, int _maxBins )
+    {
+        featureEvaluator = _featureEvaluator;
+        data = _data;
+        maxBins = _maxBins;
+    }
+    void operator()( const Range& range ) const
+    {
+        const float epsilon = FLT_EPSILON*2;
+        int sample_count = data->sample_count;
+        cv::AutoBuffer<float> valBuf(sample_count*2 + maxBins);
+        float* vals = (float*)valBuf;
+        float* sorted = vals + sample_count;
+        float* binMax = sorted + sample_count;
+        for ( int fi = range.start; fi < range.end; fi++)
+        {
+            if( fi < data->numPrecalcVal )
+            {
+                for( int si = 0; si < sample_count; si++ )
+                    vals[si] = data->getCachedVal( fi, si );
+            }
+            else
+                featureEvaluator->calcColumn( fi, sample_count, vals );
+            memcpy( sorted, vals, sample_count*sizeof(float) );
+            std::sort( sorted, sorted + sample_count );
+
+            float* thresholds = data->binThresholds.ptr<float>(fi);
+            int nb = 0;
+            for( int lo = 0; lo < sample_count; nb++ )
+            {
+                int hi = lo + max( 1, (sample_count - lo)/(maxBins - nb) );
+                while( hi < sample_count && !(sorted[hi-1] + epsilon < sorted[hi]) )
+                    hi++;
+                if( nb > 0 )
+                {
+                    float t = (binMax[nb-1] + sorted[lo])*0.5f;
+                    thresholds[nb-1] = t < sorted[lo] ? t : binMax[nb-1];
+                }
+                binMax[nb] = sorted[hi-1];
+                lo = hi;
+            }
+            data->binCounts[fi] = nb;
+
+            uchar* codes = data->binCodes.ptr(fi);
+            for( int si = 0; si < sample_count; si++ )
+                codes[si] = (uchar)(std::lower_bound( binMax, binMax + nb, vals[si] ) - binMax);
+        }
+    }
+    const CvFeatureEvaluator* featureEvaluator;
+    CvCascadeBoostTrainData* data;
+    int maxBins;
+};
+
+void CvCascadeBoostTrainData::quantizeFeatures( int maxBins, const string& swapDir )
+{
+    CV_Assert( maxBins >= 2 && maxBins <= 256 && !cat_var_count );
+    if( !swapDir.empty() )
+    {
+        void* codesData = binSwap.create( swapDir, (size_t)var_count*sample_count );
+        if( !codesData )
+            CV_Error( CV_StsError, "Cannot map a scratch file in " + swapDir );
+        binCodes = Mat( var_count, sample_count, CV_8UC1, codesData );
+    }
+    else
+        binCodes.create( var_count, sample_count, CV_8UC1 );
+    binThresholds.create( var_count, maxBins - 1, CV_32FC1 );
+    binCounts.assign( var_count, 0 );
+
+    double proctime = -TIME( 0 );
+    parallel_for_( Range(0, var_count), FeatureQuantizer(featureEvaluator, this, maxBins) );
+    cout << "Histogram binning time: " << (proctime + TIME( 0 )) << ", bin codes: "
+         << (size_t)var_count*sample_count / 1048576 << " Mb" << endl;
 }
 
 //-------------------------------- CascadeBoostTree ----------------------------------------
 
-CvDTreeNode* CvCascadeBoostTree::predict( int sampleIdx ) const
+CvDTreeNode* CvCascadeBoostTree::predict( int sampleIdx, bool exactValues ) const
 {
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
     CvDTreeNode* node = root;
     if( !node )
         CV_Error( CV_StsError, "The tree has not been trained yet" );
 
-    if ( ((CvCascadeBoostTrainData*)data)->featureEvaluator->getMaxCatCount() == 0 ) // ordered
+    if ( cdata->featureEvaluator->getMaxCatCount() == 0 ) // ordered
     {
         while( node->left )
         {
             CvDTreeSplit* split = node->split;
-            float val = ((CvCascadeBoostTrainData*)data)->getVarValue( split->var_idx, sampleIdx );
+            float val = exactValues ? (*cdata->featureEvaluator)( split->var_idx, sampleIdx ) :
+                ((CvCascadeBoostTrainData*)data)->getVarValue( split->var_idx, sampleIdx );
             node = val <= split->ord.c ? node->left : node->right;
         }
     }
@@ -909,7 +1448,8 @@ CvDTreeNode* CvCascadeBoostTree::predict( int sampleIdx ) const
         while( node->left )
         {
             CvDTreeSplit* split = node->split;
-            int c = (int)((CvCascadeBoostTrainData*)data)->getVarValue( split->var_idx, sampleIdx );
+            int c = (int)(exactValues ? (*cdata->featureEvaluator)( split->var_idx, sampleIdx ) :
+                ((CvCascadeBoostTrainData*)data)->getVarValue( split->var_idx, sampleIdx ));
             node = CV_DTREE_CAT_DIR(c, split->subset) < 0 ? node->left : node->right;
         }
     }
@@ -1051,213 +1591,830 @@ void CvCascadeBoostTree::read( const FileNode &node, CvBoost* _ensemble,
     internalNodesQueue.pop();
 }
 
-void CvCascadeBoostTree::split_node_data( CvDTreeNode* node )
-{
-    int n = node->sample_count, nl, nr, scount = data->sample_count;
-    char* dir = (char*)data->direction->data.ptr;
-    CvDTreeNode *left = 0, *right = 0;
-    int* newIdx = data->split_buf->data.i;
-    int newBufIdx = data->get_child_buf_idx( node );
-    int workVarCount = data->get_work_var_count();
-    CvMat* buf = data->buf;
-    size_t length_buf_row = data->get_length_subbuf();
-    cv::AutoBuffer<uchar> inn_buf(n*(3*sizeof(int)+sizeof(float)));
-    int* tempBuf = (int*)(uchar*)inn_buf;
-    bool splitInputData;
+// A histogram bin holds the sums of two per sample values and the sample count: the weights
+// of both classes for the classification trees, the weight and the weighted response for the
+// regression ones.
+static const int HIST_STRIDE = 3;
 
-    complete_node_dir(node);
+// The classification criteria of the split finders, as CvBoostTree resolves it: GINI unless
+// MISCLASS is asked for or, by default, with discrete AdaBoost.
+static bool isGiniCriteria( const CvBoostParams& params )
+{
+    int splitCriteria = params.split_criteria;
+    if( splitCriteria != CvBoost::GINI && splitCriteria != CvBoost::MISCLASS )
+        splitCriteria = params.boost_type == CvBoost::DISCRETE ? CvBoost::MISCLASS : CvBoost::GINI;
+    return splitCriteria == CvBoost::GINI;
+}
 
-    for( int i = nl = nr = 0; i < n; i++ )
+// Best boundary between the bins of one feature by the criteria CvBoostTree uses on the sorted values.
+static double findHistSplit( const double* hist, int numBins, bool isClassifier, bool isGini, int& bestBin )
+{
+    double tot0 = 0, tot1 = 0, totCount = 0;
+    for( int b = 0; b < numBins; b++ )
     {
-        int d = dir[i];
-        // initialize new indices for splitting ordered variables
-        newIdx[i] = (nl & (d-1)) | (nr & -d); // d ? ri : li
-        nr += d;
-        nl += d^1;
+        tot0 += hist[b*HIST_STRIDE];
+        tot1 += hist[b*HIST_STRIDE+1];
+        totCount += hist[b*HIST_STRIDE+2];
     }
 
-    node->left = left = data->new_node( node, nl, newBufIdx, node->offset );
-    node->right = right = data->new_node( node, nr, newBufIdx, node->offset + nl );
-
-    splitInputData = node->depth + 1 < data->params.max_depth &&
-        (node->left->sample_count > data->params.min_sample_count ||
-        node->right->sample_count > data->params.min_sample_count);
-
-    // split ordered variables, keep both halves sorted.
-    for( int vi = 0; vi < ((CvCascadeBoostTrainData*)data)->numPrecalcIdx; vi++ )
+    double l0 = 0, l1 = 0, lCount = 0, bestVal = 0;
+    bestBin = -1;
+    for( int b = 0; b < numBins - 1; b++ )
     {
-        int ci = data->get_var_type(vi);
-        if( ci >= 0 || !splitInputData )
+        const double* h = hist + b*HIST_STRIDE;
+        // a boundary after an empty bin gives the same partition as the previous one
+        if( h[2] < 0.5 )
             continue;
+        l0 += h[0]; l1 += h[1]; lCount += h[2];
+        if( lCount > totCount - 0.5 )
+            break;
 
-        int n1 = node->get_num_valid(vi);
-        float *src_val_buf = (float*)(tempBuf + n);
-        int *src_sorted_idx_buf = (int*)(src_val_buf + n);
-        int *src_sample_idx_buf = src_sorted_idx_buf + n;
-        const int* src_sorted_idx = 0;
-        const float* src_val = 0;
-        data->get_ord_var_data(node, vi, src_val_buf, src_sorted_idx_buf, &src_val, &src_sorted_idx, src_sample_idx_buf);
-
-        for(int i = 0; i < n; i++)
-            tempBuf[i] = src_sorted_idx[i];
-
-        if (data->is_buf_16u)
+        double r0 = tot0 - l0, r1 = tot1 - l1, val;
+        if( !isClassifier )
         {
-            ushort *ldst, *rdst;
-            ldst = (ushort*)(buf->data.s + left->buf_idx*length_buf_row +
-                vi*scount + left->offset);
-            rdst = (ushort*)(ldst + nl);
-
-            // split sorted
-            for( int i = 0; i < n1; i++ )
-            {
-                int idx = tempBuf[i];
-                int d = dir[idx];
-                idx = newIdx[idx];
-                if (d)
-                {
-                    *rdst = (ushort)idx;
-                    rdst++;
-                }
-                else
-                {
-                    *ldst = (ushort)idx;
-                    ldst++;
-                }
-            }
-            CV_Assert( n1 == n );
+            if( l0 <= 0 || r0 <= 0 )
+                continue;
+            val = (l1*l1*r0 + r1*r1*l0)/(l0*r0);
+        }
+        else if( isGini )
+        {
+            double L = l0 + l1, R = r0 + r1;
+            if( L <= 0 || R <= 0 )
+                continue;
+            val = ((l0*l0 + l1*l1)*R + (r0*r0 + r1*r1)*L)/(L*R);
         }
         else
+            val = max( l0 + r1, l1 + r0 );
+
+        if( bestVal < val )
         {
-            int *ldst, *rdst;
-            ldst = buf->data.i + left->buf_idx*length_buf_row +
-                vi*scount + left->offset;
-            rdst = buf->data.i + right->buf_idx*length_buf_row +
-                vi*scount + right->offset;
+            bestVal = val;
+            bestBin = b;
+        }
+    }
+    return bestVal;
+}
 
-            // split sorted
-            for( int i = 0; i < n1; i++ )
+// Fills the node histograms of a range of features and finds their best splits. The samples
+// given are the node ones, or the ones of its smaller sibling when the parent histograms are
+// kept, the histograms of the other node are then the difference to the parent ones.
+struct HistSplitFinder : ParallelLoopBody
+{
+    HistSplitFinder( const CvCascadeBoostTrainData* _data, bool _isClassifier, bool _isGini,
+                     double* _bestVals, int* _bestBins )
+    {
+        data = _data;
+        isClassifier = _isClassifier;
+        isGini = _isGini;
+        bestVals = _bestVals;
+        bestBins = _bestBins;
+        count = 0;
+        sampleIdx = 0;
+        sum0 = sum1 = 0;
+        isNodeSamples = true;
+        parentHist = nodeHist = siblingHist = 0;
+    }
+    void operator()( const Range& range ) const
+    {
+        int histCols = (data->binThresholds.cols + 1)*HIST_STRIDE;
+        cv::AutoBuffer<double> histBuf(histCols*2);
+        for ( int fi = range.start; fi < range.end; fi++)
+        {
+            int nb = data->binCounts[fi];
+            if( !data->activeVars.empty() && !data->activeVars[fi] )
+            {
+                bestVals[fi] = 0;
+                bestBins[fi] = -1;
+                continue;
+            }
+            double* nodeRow = nodeHist->empty() ? (double*)histBuf : nodeHist->ptr<double>(fi);
+            if( sampleIdx )
             {
-                int idx = tempBuf[i];
-                int d = dir[idx];
-                idx = newIdx[idx];
-                if (d)
+                double* siblingRow = siblingHist->empty() ? (double*)histBuf + histCols : siblingHist->ptr<double>(fi);
+                double* acc = isNodeSamples ? nodeRow : siblingRow;
+                const uchar* codes = data->binCodes.ptr(fi);
+                memset( acc, 0, nb*HIST_STRIDE*sizeof(double) );
+                for( int i = 0; i < count; i++ )
                 {
-                    *rdst = idx;
-                    rdst++;
+                    double* h = acc + codes[sampleIdx[i]]*HIST_STRIDE;
+                    h[0] += sum0[i];
+                    h[1] += sum1[i];
+                    h[2] += 1;
                 }
-                else
+                if( parentHist )
                 {
-                    *ldst = idx;
-                    ldst++;
+                    const double* p = parentHist->ptr<double>(fi);
+                    double* other = isNodeSamples ? siblingRow : nodeRow;
+                    for( int j = 0; j < nb*HIST_STRIDE; j++ )
+                        other[j] = p[j] - acc[j];
                 }
             }
-            CV_Assert( n1 == n );
+            bestVals[fi] = nb > 1 ? findHistSplit( nodeRow, nb, isClassifier, isGini, bestBins[fi] ) : 0;
+            if( nb <= 1 )
+                bestBins[fi] = -1;
         }
     }
+    const CvCascadeBoostTrainData* data;
+    bool isClassifier, isGini;
+    double* bestVals;
+    int* bestBins;
+    int count;
+    const int* sampleIdx;
+    const double* sum0;
+    const double* sum1;
+    bool isNodeSamples;
+    const Mat* parentHist;
+    Mat* nodeHist;
+    Mat* siblingHist;
+};
 
-    // split cv_labels using newIdx relocation table
-    int *src_lbls_buf = tempBuf + n;
-    const int* src_lbls = data->get_cv_labels(node, src_lbls_buf);
-
-    for(int i = 0; i < n; i++)
-        tempBuf[i] = src_lbls[i];
+// Runs the split search of the sorted values over fixed ranges of features, every range keeps
+// its best split and its own scratch buffer. The ranges are reduced in order by the caller, the
+// same split is found as by the sequential search for any number of threads.
+struct BestSplitFinder : ParallelLoopBody
+{
+    enum { RANGE_SIZE = 256 };
 
-    if (data->is_buf_16u)
+    BestSplitFinder( CvCascadeBoostTree* _tree, CvDTreeNode* _node, uchar* _splits, int _splitSize )
     {
-        unsigned short *ldst = (unsigned short *)(buf->data.s + left->buf_idx*length_buf_row +
-            (workVarCount-1)*scount + left->offset);
-        unsigned short *rdst = (unsigned short *)(buf->data.s + right->buf_idx*length_buf_row +
-            (workVarCount-1)*scount + right->offset);
-
-        for( int i = 0; i < n; i++ )
+        tree = _tree;
+        node = _node;
+        splits = _splits;
+        splitSize = _splitSize;
+    }
+    void operator()( const Range& range ) const
+    {
+        CvDTreeTrainData* data = tree->get_data();
+        const vector<uchar>& activeVars = ((CvCascadeBoostTrainData*)data)->activeVars;
+        int n = node->sample_count;
+        cv::AutoBuffer<uchar> inn_buf(2*n*(sizeof(int) + sizeof(float)));
+        cv::AutoBuffer<uchar> split_buf(splitSize);
+        CvDTreeSplit* split = (CvDTreeSplit*)(uchar*)split_buf;
+
+        for( int ri = range.start; ri < range.end; ri++ )
         {
-            int idx = tempBuf[i];
-            if (dir[i])
-            {
-                *rdst = (unsigned short)idx;
-                rdst++;
-            }
-            else
+            CvDTreeSplit* bestSplit = (CvDTreeSplit*)(splits + (size_t)ri*splitSize);
+            memset( bestSplit, 0, splitSize );
+            int vi1 = ri*RANGE_SIZE, vi2 = min( vi1 + RANGE_SIZE, data->var_count );
+            for( int vi = vi1; vi < vi2; vi++ )
             {
-                *ldst = (unsigned short)idx;
-                ldst++;
+                CvDTreeSplit* res;
+                int ci = data->get_var_type(vi);
+                if( node->get_num_valid(vi) <= 1 || (!activeVars.empty() && !activeVars[vi]) )
+                    continue;
+
+                if( data->is_classifier )
+                    res = ci >= 0 ? tree->find_split_cat_class( node, vi, bestSplit->quality, split, (uchar*)inn_buf ) :
+                                    tree->find_split_ord_class( node, vi, bestSplit->quality, split, (uchar*)inn_buf );
+                else
+                    res = ci >= 0 ? tree->find_split_cat_reg( node, vi, bestSplit->quality, split, (uchar*)inn_buf ) :
+                                    tree->find_split_ord_reg( node, vi, bestSplit->quality, split, (uchar*)inn_buf );
+
+                if( res && bestSplit->quality < split->quality )
+                    memcpy( bestSplit, split, splitSize );
             }
         }
+    }
+    CvCascadeBoostTree* tree;
+    CvDTreeNode* node;
+    uchar* splits;
+    int splitSize;
+};
 
+void CvCascadeBoostTree::getHistSamples( CvDTreeNode* node, vector<int>& sampleIdx,
+                                         vector<double>& sum0, vector<double>& sum1 )
+{
+    int n = node->sample_count;
+    const double* weights = ensemble->get_weights()->data.db;
+    cv::AutoBuffer<int> inn_buf(n*3);
+    int* ibuf = (int*)inn_buf;
+
+    const int* sidx = data->get_sample_indices( node, ibuf );
+    sampleIdx.assign( sidx, sidx + n );
+    const int* labels = data->get_cv_labels( node, ibuf );
+    sum0.resize( n );
+    sum1.resize( n );
+    if( data->is_classifier )
+    {
+        const double* priors = data->priors_mult->data.db;
+        const int* responses = data->get_class_labels( node, ibuf + n );
+        for( int i = 0; i < n; i++ )
+        {
+            double w = priors[responses[i]]*weights[labels[i]];
+            sum0[i] = responses[i] ? 0 : w;
+            sum1[i] = responses[i] ? w : 0;
+        }
     }
     else
     {
-        int *ldst = buf->data.i + left->buf_idx*length_buf_row +
-            (workVarCount-1)*scount + left->offset;
-        int *rdst = buf->data.i + right->buf_idx*length_buf_row +
-            (workVarCount-1)*scount + right->offset;
-
+        const float* responses = data->get_ord_responses( node, (float*)(ibuf + n), ibuf + 2*n );
         for( int i = 0; i < n; i++ )
         {
-            int idx = tempBuf[i];
-            if (dir[i])
-            {
-                *rdst = idx;
-                rdst++;
-            }
-            else
-            {
-                *ldst = idx;
-                ldst++;
-            }
+            double w = weights[labels[i]];
+            sum0[i] = w;
+            sum1[i] = w*responses[i];
         }
     }
+}
 
-    // split sample indices
-    int *sampleIdx_src_buf = tempBuf + n;
-    const int* sampleIdx_src = data->get_sample_indices(node, sampleIdx_src_buf);
+CvDTreeSplit* CvCascadeBoostTree::find_best_split( CvDTreeNode* node )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    if( cdata->binCodes.empty() )
+    {
+        int splitSize = data->split_heap->elem_size;
+        int rangeCount = (data->var_count + BestSplitFinder::RANGE_SIZE - 1)/BestSplitFinder::RANGE_SIZE;
+        vector<uchar> splits( (size_t)rangeCount*splitSize );
+        parallel_for_( Range(0, rangeCount), BestSplitFinder(this, node, &splits[0], splitSize) );
 
-    for(int i = 0; i < n; i++)
-        tempBuf[i] = sampleIdx_src[i];
+        CvDTreeSplit* best = 0;
+        for( int ri = 0; ri < rangeCount; ri++ )
+        {
+            CvDTreeSplit* split = (CvDTreeSplit*)&splits[(size_t)ri*splitSize];
+            if( split->quality > 0 && (!best || best->quality < split->quality) )
+                best = split;
+        }
+        if( !best )
+            return 0;
+        CvDTreeSplit* bestSplit = data->new_split_cat( 0, -1.0f );
+        memcpy( bestSplit, best, splitSize );
+        return bestSplit;
+    }
 
-    if (data->is_buf_16u)
+    int varCount = data->var_count, maxDepth = data->params.max_depth;
+    int histCols = (cdata->binThresholds.cols + 1)*HIST_STRIDE;
+    // the histograms of a node and of its sibling are kept per level of the tree
+    bool keepHists = maxDepth > 1 &&
+        (double)varCount*histCols*sizeof(double)*2*maxDepth <= (double)cdata->histBufSize;
+
+    bool isGini = isGiniCriteria( ensemble->get_params() );
+    vector<double> bestVals( varCount );
+    vector<int> bestBins( varCount );
+    HistSplitFinder finder( cdata, data->is_classifier, isGini, &bestVals[0], &bestBins[0] );
+
+    CvDTreeNode* parent = node->parent;
+    CvDTreeNode* sibling = parent ? (parent->left == node ? parent->right : parent->left) : 0;
+    map<CvDTreeNode*, Mat>::iterator nodeIt = nodeHists.find( node );
+    map<CvDTreeNode*, Mat>::iterator parentIt = parent ? nodeHists.find( parent ) : nodeHists.end();
+    vector<int> sampleIdx;
+    vector<double> sum0, sum1;
+    Mat nodeHist, siblingHist;
+
+    if( nodeIt != nodeHists.end() )
+        nodeHist = nodeIt->second; // left by the sibling
+    else
     {
-        unsigned short* ldst = (unsigned short*)(buf->data.s + left->buf_idx*length_buf_row +
-            workVarCount*scount + left->offset);
-        unsigned short* rdst = (unsigned short*)(buf->data.s + right->buf_idx*length_buf_row +
-            workVarCount*scount + right->offset);
-        for (int i = 0; i < n; i++)
+        bool isSubtracted = keepHists && parentIt != nodeHists.end();
+        CvDTreeNode* accNode = isSubtracted && sibling->sample_count < node->sample_count ? sibling : node;
+        getHistSamples( accNode, sampleIdx, sum0, sum1 );
+        finder.count = accNode->sample_count;
+        finder.sampleIdx = &sampleIdx[0];
+        finder.sum0 = &sum0[0];
+        finder.sum1 = &sum1[0];
+        finder.isNodeSamples = accNode == node;
+        if( isSubtracted )
+        {
+            finder.parentHist = &parentIt->second;
+            siblingHist.create( varCount, histCols, CV_64FC1 );
+        }
+        if( keepHists && node->depth + 1 < maxDepth )
+            nodeHist.create( varCount, histCols, CV_64FC1 );
+    }
+    finder.nodeHist = &nodeHist;
+    finder.siblingHist = &siblingHist;
+    parallel_for_( Range(0, varCount), finder );
+
+    if( parentIt != nodeHists.end() )
+        nodeHists.erase( parentIt );
+    if( !siblingHist.empty() )
+        nodeHists[sibling] = siblingHist;
+    if( !nodeHist.empty() && node->depth + 1 < maxDepth )
+        nodeHists[node] = nodeHist;
+    else
+        nodeHists.erase( node );
+
+    // reduced in the feature order, the same split is found with any number of threads
+    int bestVi = -1;
+    double bestVal = 0;
+    for( int vi = 0; vi < varCount; vi++ )
+    {
+        if( bestBins[vi] >= 0 && bestVal < bestVals[vi] )
+        {
+            bestVal = bestVals[vi];
+            bestVi = vi;
+        }
+    }
+    if( bestVi < 0 )
+        return 0;
+
+    int bin = bestBins[bestVi];
+    return data->new_split_ord( bestVi, cdata->binThresholds.at<float>(bestVi, bin), bin, 0, (float)bestVal );
+}
+
+struct ByteCatLess
+{
+    ByteCatLess( const double* _keys ) : keys( _keys ) {}
+    bool operator()( int a, int b ) const
+    {
+        return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+    }
+    const double* keys;
+};
+
+CvDTreeSplit* CvCascadeBoostTree::find_split_cat_class( CvDTreeNode* node, int vi, float init_quality,
+                                                        CvDTreeSplit* _split, uchar* _ext_buf )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    if( cdata->valCache.depth() == CV_8U && vi < cdata->numPrecalcVal )
+        return findByteCatSplit( node, vi, init_quality, _split, _ext_buf );
+    return CvBoostTree::find_split_cat_class( node, vi, init_quality, _split, _ext_buf );
+}
+
+CvDTreeSplit* CvCascadeBoostTree::find_split_cat_reg( CvDTreeNode* node, int vi, float init_quality,
+                                                      CvDTreeSplit* _split, uchar* _ext_buf )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    if( cdata->valCache.depth() == CV_8U && vi < cdata->numPrecalcVal )
+        return findByteCatSplit( node, vi, init_quality, _split, _ext_buf );
+    return CvBoostTree::find_split_cat_reg( node, vi, init_quality, _split, _ext_buf );
+}
+
+// Categorical split of a feature whose codes are cached as bytes (LBP). The weighted sums of
+// the node samples go to fixed 256 entry histograms read straight from the cached codes, the
+// non-empty categories are ordered by the class 1 weight (classification) or by the mean
+// response (regression) and the best cut of that order gives the subset, as in CvBoostTree.
+CvDTreeSplit* CvCascadeBoostTree::findByteCatSplit( CvDTreeNode* node, int vi, float init_quality,
+                                                    CvDTreeSplit* _split, uchar* _ext_buf )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    int n = node->sample_count;
+    cv::AutoBuffer<int> inn_buf(_ext_buf ? 0 : 3*n);
+    int* ibuf = _ext_buf ? (int*)_ext_buf : (int*)inn_buf;
+    const int* sampleIdx = data->get_sample_indices( node, ibuf );
+    const uchar* codes = cdata->cachedRow( vi );
+    const double* weights = ensemble->get_subtree_weights()->data.db;
+    double sum0[256], sum1[256], keys[256];
+    int order[256], count = 0;
+
+    memset( sum0, 0, sizeof(sum0) );
+    memset( sum1, 0, sizeof(sum1) );
+    if( data->is_classifier )
+    {
+        // sum0, sum1 - weights of the classes
+        const int* responses = data->get_class_labels( node, ibuf + n );
+        for( int i = 0; i < n; i++ )
         {
-            unsigned short idx = (unsigned short)tempBuf[i];
-            if (dir[i])
+            int c = codes[sampleIdx[i]];
+            double w = weights[i];
+            sum0[c] += responses[i] ? 0 : w;
+            sum1[c] += responses[i] ? w : 0;
+        }
+    }
+    else
+    {
+        // sum0, sum1 - weight and weighted response
+        const float* responses = data->get_ord_responses( node, (float*)(ibuf + 2*n), ibuf + n );
+        for( int i = 0; i < n; i++ )
+        {
+            int c = codes[sampleIdx[i]];
+            double w = weights[i];
+            sum0[c] += w;
+            sum1[c] += responses[i]*w;
+        }
+    }
+
+    double tot0 = 0, tot1 = 0;
+    for( int c = 0; c < 256; c++ )
+    {
+        tot0 += sum0[c];
+        tot1 += sum1[c];
+        double weight = data->is_classifier ? sum0[c] + sum1[c] : sum0[c];
+        if( weight < FLT_EPSILON )
+            continue;
+        keys[c] = data->is_classifier ? sum1[c] : sum1[c]/sum0[c];
+        order[count++] = c;
+    }
+    std::sort( order, order + count, ByteCatLess(keys) );
+
+    bool isGini = isGiniCriteria( ensemble->get_params() );
+
+    double l0 = 0, l1 = 0, bestVal = init_quality;
+    int bestSubset = -1;
+    for( int k = 0; k < count - 1; k++ )
+    {
+        int c = order[k];
+        l0 += sum0[c];
+        l1 += sum1[c];
+        double r0 = tot0 - l0, r1 = tot1 - l1, val;
+        if( !data->is_classifier )
+        {
+            if( l0 <= FLT_EPSILON || r0 <= FLT_EPSILON )
+                continue;
+            val = (l1*l1*r0 + r1*r1*l0)/(l0*r0);
+        }
+        else if( isGini )
+        {
+            double L = l0 + l1, R = r0 + r1;
+            if( L <= FLT_EPSILON || R <= FLT_EPSILON )
+                continue;
+            val = ((l0*l0 + l1*l1)*R + (r0*r0 + r1*r1)*L)/(L*R);
+        }
+        else
+            val = max( l0 + r1, l1 + r0 );
+
+        if( bestVal < val )
+        {
+            bestVal = val;
+            bestSubset = k;
+        }
+    }
+
+    CvDTreeSplit* split = 0;
+    if( bestSubset >= 0 )
+    {
+        split = _split ? _split : data->new_split_cat( 0, -1.0f );
+        split->var_idx = vi;
+        split->quality = (float)bestVal;
+        memset( split->subset, 0, (data->max_c_count + 31)/32 * sizeof(int) );
+        for( int k = 0; k <= bestSubset; k++ )
+            split->subset[order[k] >> 5] |= 1 << (order[k] & 31);
+    }
+    return split;
+}
+
+double CvCascadeBoostTree::calc_node_dir( CvDTreeNode* node )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    CvDTreeSplit* split = node->split;
+    if( cdata->binCodes.empty() )
+        return CvBoostTree::calc_node_dir( node );
+
+    // the split point of the histogram splits is the last bin going to the left,
+    // the sample weights are the ensemble ones as several nodes are split at once
+    // when growing by levels
+    char* dir = (char*)data->direction->data.ptr;
+    const double* weights = ensemble->get_weights()->data.db;
+    const uchar* codes = cdata->binCodes.ptr( split->var_idx );
+    int n = node->sample_count, bin = split->ord.split_point;
+    cv::AutoBuffer<int> inn_buf(n*2);
+    const int* sampleIdx = data->get_sample_indices( node, (int*)inn_buf );
+    const int* labels = data->get_cv_labels( node, (int*)inn_buf + n );
+    double L = 0, R = 0;
+
+    for( int i = 0; i < n; i++ )
+    {
+        if( codes[sampleIdx[i]] <= bin )
+        {
+            dir[i] = (char)-1;
+            L += weights[labels[i]];
+        }
+        else
+        {
+            dir[i] = (char)1;
+            R += weights[labels[i]];
+        }
+    }
+    node->maxlr = MAX( L, R );
+    return split->quality/(L + R);
+}
+
+void CvCascadeBoostTree::try_split_node( CvDTreeNode* node )
+{
+    if( node->depth == 0 && ((CvCascadeBoostTrainData*)data)->levelGrowth )
+    {
+        growLevels( node );
+        return;
+    }
+    CvBoostTree::try_split_node( node );
+    // the histograms of a node are not needed once its subtree is grown
+    nodeHists.erase( node );
+}
+
+// The stopping rules of CvDTree::try_split_node, node values are already calculated.
+bool CvCascadeBoostTree::canSplitNode( CvDTreeNode* node )
+{
+    int n = node->sample_count;
+    if( n <= data->params.min_sample_count || node->depth >= data->params.max_depth )
+        return false;
+    if( data->is_classifier )
+    {
+        // a pure node is not split
+        cv::AutoBuffer<int> inn_buf(n);
+        const int* responses = data->get_class_labels( node, (int*)inn_buf );
+        for( int i = 1; i < n; i++ )
+            if( responses[i] != responses[0] )
+                return true;
+        return false;
+    }
+    return !(sqrt(node->node_risk)/n < data->params.regression_accuracy);
+}
+
+// Leaves store their value as the response of their samples, as CvBoostTree::try_split_node does.
+void CvCascadeBoostTree::setLeaf( CvDTreeNode* node )
+{
+    double* weakEval = ensemble->get_weak_response()->data.db;
+    cv::AutoBuffer<int> inn_buf(node->sample_count);
+    const int* labels = data->get_cv_labels( node, (int*)inn_buf );
+    for( int i = 0; i < node->sample_count; i++ )
+        weakEval[labels[i]] = node->value;
+    data->free_node_data( node );
+}
+
+// Breadth-first version of try_split_node: the splits of the nodes of a level are found
+// together, the node data is then split node by node as before. The nodes get the same
+// splits as when grown depth-first since they only depend on the node samples.
+void CvCascadeBoostTree::growLevels( CvDTreeNode* root )
+{
+    vector<CvDTreeNode*> level( 1, root ), open;
+    vector<CvDTreeSplit*> splits;
+    while( !level.empty() )
+    {
+        open.clear();
+        for( size_t k = 0; k < level.size(); k++ )
+        {
+            calc_node_value( level[k] );
+            if( canSplitNode( level[k] ) )
+                open.push_back( level[k] );
+            else
+                setLeaf( level[k] );
+        }
+        if( open.empty() )
+            break;
+
+        findLevelSplits( open, splits );
+        level.clear();
+        for( size_t k = 0; k < open.size(); k++ )
+        {
+            CvDTreeNode* node = open[k];
+            if( !splits[k] )
             {
-                *rdst = idx;
-                rdst++;
+                setLeaf( node );
+                continue;
             }
-            else
+            node->split = splits[k];
+            calc_node_dir( node );
+            split_node_data( node );
+            level.push_back( node->left );
+            level.push_back( node->right );
+        }
+    }
+}
+
+// Accumulates the histograms of all nodes of a level in one pass over the bin codes of each
+// feature. The samples are visited in index order, which is the order of the samples inside
+// every node, so the sums are the ones find_best_split gets without subtraction.
+struct LevelHistSplitFinder : ParallelLoopBody
+{
+    LevelHistSplitFinder( const CvCascadeBoostTrainData* _data, bool _isClassifier, bool _isGini,
+                          int _nodeCount, const vector<int>& _samples, const vector<int>& _nodeOf,
+                          const vector<double>& _sum0, const vector<double>& _sum1,
+                          double* _bestVals, int* _bestBins )
+    {
+        data = _data;
+        isClassifier = _isClassifier;
+        isGini = _isGini;
+        nodeCount = _nodeCount;
+        samples = &_samples;
+        nodeOf = &_nodeOf;
+        sum0 = &_sum0;
+        sum1 = &_sum1;
+        bestVals = _bestVals;
+        bestBins = _bestBins;
+    }
+    void operator()( const Range& range ) const
+    {
+        int histCols = (data->binThresholds.cols + 1)*HIST_STRIDE;
+        int varCount = data->var_count, count = (int)samples->size();
+        cv::AutoBuffer<double> histBuf(histCols*nodeCount);
+        double* hists = (double*)histBuf;
+        const int* sidx = &(*samples)[0];
+        const int* node = &(*nodeOf)[0];
+        const double* s0 = &(*sum0)[0];
+        const double* s1 = &(*sum1)[0];
+        for ( int fi = range.start; fi < range.end; fi++)
+        {
+            int nb = data->binCounts[fi];
+            if( !data->activeVars.empty() && !data->activeVars[fi] )
+                nb = 0; // not searched by this tree
+            const uchar* codes = data->binCodes.ptr(fi);
+            for( int k = 0; k < nodeCount; k++ )
+                memset( hists + k*histCols, 0, nb*HIST_STRIDE*sizeof(double) );
+            for( int i = 0; i < (nb > 1 ? count : 0); i++ )
+            {
+                int si = sidx[i];
+                double* h = hists + node[si]*histCols + codes[si]*HIST_STRIDE;
+                h[0] += s0[si];
+                h[1] += s1[si];
+                h[2] += 1;
+            }
+            for( int k = 0; k < nodeCount; k++ )
             {
-                *ldst = idx;
-                ldst++;
+                int* bin = bestBins + (size_t)k*varCount + fi;
+                bestVals[(size_t)k*varCount + fi] = nb > 1 ?
+                    findHistSplit( hists + k*histCols, nb, isClassifier, isGini, *bin ) : 0;
+                if( nb <= 1 )
+                    *bin = -1;
             }
         }
     }
-    else
+    const CvCascadeBoostTrainData* data;
+    bool isClassifier, isGini;
+    int nodeCount;
+    const vector<int>* samples;
+    const vector<int>* nodeOf;
+    const vector<double>* sum0;
+    const vector<double>* sum1;
+    double* bestVals;
+    int* bestBins;
+};
+
+void CvCascadeBoostTree::findLevelSplits( const vector<CvDTreeNode*>& nodes, vector<CvDTreeSplit*>& splits )
+{
+    const CvCascadeBoostTrainData* cdata = (const CvCascadeBoostTrainData*)data;
+    int varCount = data->var_count, nodeCount = (int)nodes.size(), sampleCount = data->sample_count;
+    vector<int> nodeOf( sampleCount, -1 ), samples;
+    vector<double> sum0( sampleCount ), sum1( sampleCount );
+    vector<int> nodeIdx;
+    vector<double> nodeSum0, nodeSum1;
+    for( int k = 0; k < nodeCount; k++ )
     {
-        int* ldst = buf->data.i + left->buf_idx*length_buf_row +
-            workVarCount*scount + left->offset;
-        int* rdst = buf->data.i + right->buf_idx*length_buf_row +
-            workVarCount*scount + right->offset;
-        for (int i = 0; i < n; i++)
+        getHistSamples( nodes[k], nodeIdx, nodeSum0, nodeSum1 );
+        for( size_t i = 0; i < nodeIdx.size(); i++ )
+        {
+            int si = nodeIdx[i];
+            nodeOf[si] = k;
+            sum0[si] = nodeSum0[i];
+            sum1[si] = nodeSum1[i];
+        }
+    }
+    for( int si = 0; si < sampleCount; si++ )
+        if( nodeOf[si] >= 0 )
+            samples.push_back( si );
+
+    bool isGini = isGiniCriteria( ensemble->get_params() );
+    vector<double> bestVals( (size_t)nodeCount*varCount );
+    vector<int> bestBins( (size_t)nodeCount*varCount );
+    parallel_for_( Range(0, varCount),
+                   LevelHistSplitFinder(cdata, data->is_classifier, isGini, nodeCount,
+                                        samples, nodeOf, sum0, sum1, &bestVals[0], &bestBins[0]) );
+
+    splits.assign( nodeCount, (CvDTreeSplit*)0 );
+    for( int k = 0; k < nodeCount; k++ )
+    {
+        const double* vals = &bestVals[(size_t)k*varCount];
+        const int* bins = &bestBins[(size_t)k*varCount];
+        int bestVi = -1;
+        double bestVal = 0;
+        for( int vi = 0; vi < varCount; vi++ )
         {
-            int idx = tempBuf[i];
-            if (dir[i])
+            if( bins[vi] >= 0 && bestVal < vals[vi] )
             {
-                *rdst = idx;
-                rdst++;
+                bestVal = vals[vi];
+                bestVi = vi;
+            }
+        }
+        if( bestVi >= 0 )
+            splits[k] = data->new_split_ord( bestVi, cdata->binThresholds.at<float>(bestVi, bins[bestVi]),
+                                             bins[bestVi], 0, (float)bestVal );
+    }
+}
+
+// Splits the sorted indices of a range of ordered variables between the children of a node,
+// every variable is an independent row of the buffer.
+struct SortedIdxSplitter : ParallelLoopBody
+{
+    SortedIdxSplitter( CvDTreeTrainData* _data, CvDTreeNode* _node, const int* _newIdx )
+    {
+        data = _data;
+        node = _node;
+        newIdx = _newIdx;
+    }
+    void operator()( const Range& range ) const
+    {
+        const CvTrainKernels& kernels = getTrainKernels();
+        int n = node->sample_count, scount = data->sample_count;
+        CvDTreeNode *left = node->left, *right = node->right;
+        CvMat* buf = data->buf;
+        size_t length_buf_row = data->get_length_subbuf();
+        cv::AutoBuffer<int> inn_buf(n);
+        int* tempBuf = (int*)inn_buf;
+
+        for( int vi = range.start; vi < range.end; vi++ )
+        {
+            CV_Assert( node->get_num_valid(vi) == n );
+            // the children may reuse the parent buffer, so the source is copied first
+            ((CvCascadeBoostTrainData*)data)->copySortedIdx( node, vi, tempBuf );
+            if (data->is_buf_16u)
+            {
+                ushort *ldst, *rdst;
+                ldst = (ushort*)(buf->data.s + left->buf_idx*length_buf_row +
+                    (size_t)vi*scount + left->offset);
+                rdst = (ushort*)(ldst + left->sample_count);
+                kernels.partitionSorted16u( tempBuf, newIdx, n, ldst, rdst );
             }
             else
             {
-                *ldst = idx;
-                ldst++;
+                int *ldst, *rdst;
+                ldst = buf->data.i + left->buf_idx*length_buf_row +
+                    (size_t)vi*scount + left->offset;
+                rdst = buf->data.i + right->buf_idx*length_buf_row +
+                    (size_t)vi*scount + right->offset;
+                kernels.partitionSorted32s( tempBuf, newIdx, n, ldst, rdst );
             }
         }
     }
+    CvDTreeTrainData* data;
+    CvDTreeNode* node;
+    const int* newIdx;
+};
+
+void CvCascadeBoostTree::split_node_data( CvDTreeNode* node )
+{
+    int n = node->sample_count, nl, nr, scount = data->sample_count;
+    char* dir = (char*)data->direction->data.ptr;
+    CvDTreeNode *left = 0, *right = 0;
+    int* newIdx = data->split_buf->data.i;
+    int newBufIdx = data->get_child_buf_idx( node );
+    int workVarCount = data->get_work_var_count();
+    CvMat* buf = data->buf;
+    size_t length_buf_row = data->get_length_subbuf();
+    cv::AutoBuffer<uchar> inn_buf(n*2*sizeof(int));
+    int* tempBuf = (int*)(uchar*)inn_buf;
+    bool splitInputData;
+
+    const CvTrainKernels& kernels = getTrainKernels();
+
+    complete_node_dir(node);
+
+    for( int i = nl = nr = 0; i < n; i++ )
+    {
+        int d = dir[i];
+        // initialize new indices for splitting ordered variables,
+        // the direction goes to the sign bit for the partition kernels
+        newIdx[i] = ((nl & (d-1)) | (nr & -d)) | (int)((unsigned)d << 31); // d ? ri : li
+        nr += d;
+        nl += d^1;
+    }
+
+    node->left = left = data->new_node( node, nl, newBufIdx, node->offset );
+    node->right = right = data->new_node( node, nr, newBufIdx, node->offset + nl );
+
+    splitInputData = node->depth + 1 < data->params.max_depth &&
+        (node->left->sample_count > data->params.min_sample_count ||
+        node->right->sample_count > data->params.min_sample_count);
+
+    // split ordered variables, keep both halves sorted.
+    if( splitInputData && !data->cat_var_count )
+        parallel_for_( Range(0, ((CvCascadeBoostTrainData*)data)->numPrecalcIdx),
+                       SortedIdxSplitter(data, node, newIdx) );
+
+    // split cv_labels using newIdx relocation table
+    int *src_lbls_buf = tempBuf + n;
+    const int* src_lbls = data->get_cv_labels(node, src_lbls_buf);
+
+    for(int i = 0; i < n; i++)
+        tempBuf[i] = src_lbls[i];
+
+    if (data->is_buf_16u)
+    {
+        unsigned short *ldst = (unsigned short *)(buf->data.s + left->buf_idx*length_buf_row +
+            (size_t)(workVarCount-1)*scount + left->offset);
+        unsigned short *rdst = (unsigned short *)(buf->data.s + right->buf_idx*length_buf_row +
+            (size_t)(workVarCount-1)*scount + right->offset);
+        kernels.partition16u( tempBuf, dir, n, ldst, rdst );
+    }
+    else
+    {
+        int *ldst = buf->data.i + left->buf_idx*length_buf_row +
+            (size_t)(workVarCount-1)*scount + left->offset;
+        int *rdst = buf->data.i + right->buf_idx*length_buf_row +
+            (size_t)(workVarCount-1)*scount + right->offset;
+        kernels.partition32s( tempBuf, dir, n, ldst, rdst );
+    }
+
+    // split sample indices
+    int *sampleIdx_src_buf = tempBuf + n;
+    const int* sampleIdx_src = data->get_sample_indices(node, sampleIdx_src_buf);
+
+    for(int i = 0; i < n; i++)
+        tempBuf[i] = sampleIdx_src[i];
+
+    if (data->is_buf_16u)
+    {
+        unsigned short* ldst = (unsigned short*)(buf->data.s + left->buf_idx*length_buf_row +
+            (size_t)workVarCount*scount + left->offset);
+        unsigned short* rdst = (unsigned short*)(buf->data.s + right->buf_idx*length_buf_row +
+            (size_t)workVarCount*scount + right->offset);
+        kernels.partition16u( tempBuf, dir, n, ldst, rdst );
+    }
+    else
+    {
+        int* ldst = buf->data.i + left->buf_idx*length_buf_row +
+            (size_t)workVarCount*scount + left->offset;
+        int* rdst = buf->data.i + right->buf_idx*length_buf_row +
+            (size_t)workVarCount*scount + right->offset;
+        kernels.partition32s( tempBuf, dir, n, ldst, rdst );
+    }
 
     for( int vi = 0; vi < data->var_count; vi++ )
     {
@@ -1289,23 +2446,31 @@ void CvCascadeBoostTree::markFeaturesInMap( Mat& featureMap )
 bool CvCascadeBoost::train( const CvFeatureEvaluator* _featureEvaluator,
                            int _numSamples,
                            int _precalcValBufSize, int _precalcIdxBufSize,
-                           const CvCascadeBoostParams& _params )
+                           const CvCascadeBoostParams& _params,
+                           CvCascadeSampleCache* _sampleCache )
 {
     bool isTrained = false;
     CV_Assert( !data );
     clear();
     data = new CvCascadeBoostTrainData( _featureEvaluator, _numSamples,
-                                        _precalcValBufSize, _precalcIdxBufSize, _params );
+                                        _precalcValBufSize, _precalcIdxBufSize, _params, _sampleCache );
     CvMemStorage *storage = cvCreateMemStorage();
     weak = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvBoostTree*), storage );
     storage = 0;
 
     set_params( _params );
+    rng = cv::RNG( (uint64)(unsigned)_params.seed );
+    gossWeights.clear();
     if ( (_params.boost_type == LOGIT) || (_params.boost_type == GENTLE) )
         data->do_responses_copy();
 
     update_weights( 0 );
+    scores.assign( data->sample_count, 0. );
+    scoredCount = 0;
 
+    if( featureFraction < 1.F )
+        cout << "Feature subspace: " << max( 1, cvRound( data->var_count*featureFraction ) ) << " of "
+             << data->var_count << " features per tree, seed " << _params.seed << endl;
     cout << "+----+---------+---------+" << endl;
     cout << "|  N |    HR   |    FA   |" << endl;
     cout << "+----+---------+---------+" << endl;
@@ -1313,6 +2478,7 @@ bool CvCascadeBoost::train( const CvFeatureEvaluator* _featureEvaluator,
     do
     {
         CvCascadeBoostTree* tree = new CvCascadeBoostTree;
+        sampleFeatures();
         if( !tree->train( data, subsample_mask, this ) )
         {
             delete tree;
@@ -1328,7 +2494,11 @@ bool CvCascadeBoost::train( const CvFeatureEvaluator* _featureEvaluator,
 
     if(weak->total > 0)
     {
+        reportQuantizationEffect();
+        ((CvCascadeBoostTrainData*)data)->activeVars.clear();
+        vector<double>().swap( scores );
         data->is_classifier = true;
+        ((CvCascadeBoostTrainData*)data)->saveSampleCache();
         data->free_train_data();
         isTrained = true;
     }
@@ -1360,13 +2530,141 @@ bool CvCascadeBoost::set_params( const CvBoostParams& _params )
 {
     minHitRate = ((CvCascadeBoostParams&)_params).minHitRate;
     maxFalseAlarm = ((CvCascadeBoostParams&)_params).maxFalseAlarm;
+    gossTopRate = ((CvCascadeBoostParams&)_params).gossTopRate;
+    gossOtherRate = ((CvCascadeBoostParams&)_params).gossOtherRate;
+    featureFraction = ((CvCascadeBoostParams&)_params).featureFraction;
     return ( ( minHitRate > 0 ) && ( minHitRate < 1) &&
         ( maxFalseAlarm > 0 ) && ( maxFalseAlarm < 1) &&
         CvBoost::set_params( _params ));
 }
 
+// The per-round passes of update_weights. The samples are cut into fixed chunks, every chunk
+// keeps its own partial sums and they are added in the chunk order, so the weights do not
+// depend on the number of threads.
+struct WeightsUpdater : ParallelLoopBody
+{
+    enum { PREDICT = 0, DISCRETE_ERROR, DISCRETE_UPDATE, EXP_UPDATE, LOGIT_UPDATE, NORMALIZE };
+    static const int CHUNK_SIZE = 1 << 14;
+
+    WeightsUpdater( CvCascadeBoost* _boost, CvCascadeBoostTree* _tree,
+                    float* _fdata, int _step, const int* _sampleIdx )
+    {
+        boost = _boost;
+        tree = _tree;
+        fdata = _fdata;
+        step = _step;
+        sampleIdx = _sampleIdx;
+        n = boost->data->sample_count;
+        pass = PREDICT;
+        scale[0] = scale[1] = 1.;
+        sumBuf.resize( ((n + CHUNK_SIZE - 1)/CHUNK_SIZE)*2 );
+        sums = sumBuf.empty() ? 0 : &sumBuf[0];
+    }
+    // runs the pass over all the chunks, returns the sums of the chunks
+    double run( int _pass, double* sum1 = 0 )
+    {
+        pass = _pass;
+        parallel_for_( Range(0, (int)sumBuf.size()/2), *this );
+        double s0 = 0, s1 = 0;
+        for( size_t ci = 0; ci < sumBuf.size(); ci += 2 )
+        {
+            s0 += sumBuf[ci];
+            s1 += sumBuf[ci+1];
+        }
+        if( sum1 )
+            *sum1 = s1;
+        return s0;
+    }
+    void operator()( const Range& range ) const
+    {
+        const double lbWeightThresh = FLT_EPSILON;
+        const double lbZMax = 10.;
+        double* w = boost->weights->data.db;
+        double* eval = boost->weak_eval->data.db;
+        const int* resp = boost->orig_response->data.i;
+        const uchar* mask = boost->subsample_mask->data.ptr;
+
+        for( int ci = range.start; ci < range.end; ci++ )
+        {
+            int i1 = ci*CHUNK_SIZE, i2 = min( i1 + CHUNK_SIZE, n );
+            Mat chunkEval( 1, i2 - i1, CV_64F, eval + i1 );
+            double s0 = 0, s1 = 0;
+            switch( pass )
+            {
+            case PREDICT:
+                for( int i = i1; i < i2; i++ )
+                    if( mask[i] )
+                        eval[i] = tree->predict( i )->value;
+                break;
+            case DISCRETE_ERROR:
+                for( int i = i1; i < i2; i++ )
+                {
+                    s0 += w[i];
+                    s1 += w[i]*(eval[i] != resp[i]);
+                }
+                break;
+            case DISCRETE_UPDATE:
+                for( int i = i1; i < i2; i++ )
+                {
+                    w[i] *= scale[eval[i] != resp[i]];
+                    s0 += w[i];
+                }
+                break;
+            case EXP_UPDATE:
+                for( int i = i1; i < i2; i++ )
+                    eval[i] *= -resp[i];
+                cv::exp( chunkEval, chunkEval );
+                for( int i = i1; i < i2; i++ )
+                {
+                    w[i] *= eval[i];
+                    s0 += w[i];
+                }
+                break;
+            case LOGIT_UPDATE:
+                for( int i = i1; i < i2; i++ )
+                {
+                    double s = boost->sum_response->data.db[i] + 0.5*eval[i];
+                    boost->sum_response->data.db[i] = s;
+                    eval[i] = -2*s;
+                }
+                cv::exp( chunkEval, chunkEval );
+                for( int i = i1; i < i2; i++ )
+                {
+                    double p = 1./(1. + eval[i]);
+                    w[i] = MAX( p*(1 - p), lbWeightThresh );
+                    s0 += w[i];
+                    if( resp[i] > 0 )
+                        fdata[sampleIdx[i]*step] = (float)min(1./p, lbZMax);
+                    else
+                        fdata[sampleIdx[i]*step] = (float)-min(1./(1-p), lbZMax);
+                }
+                break;
+            default:
+                for( int i = i1; i < i2; i++ )
+                    w[i] *= scale[0];
+            }
+            sums[ci*2] = s0;
+            sums[ci*2+1] = s1;
+        }
+    }
+    CvCascadeBoost* boost;
+    CvCascadeBoostTree* tree;
+    float* fdata;
+    int step;
+    const int* sampleIdx;
+    int n, pass;
+    double scale[2];
+    vector<double> sumBuf;
+    double* sums;
+};
+
 void CvCascadeBoost::update_weights( CvBoostTree* tree )
 {
+    // the boosting goes on from the weights before the sampling
+    for( size_t i = 0; i < gossWeights.size(); i++ )
+        weights->data.db[gossWeights[i].first] = gossWeights[i].second;
+    gossWeights.clear();
+
     int n = data->sample_count;
     double sumW = 0.;
     int step = 0;
@@ -1411,7 +2709,7 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
         if (data->is_buf_16u)
         {
             unsigned short* labels = (unsigned short*)(buf->data.s + data->data_root->buf_idx*length_buf_row +
-                data->data_root->offset + (data->work_var_count-1)*data->sample_count);
+                data->data_root->offset + (size_t)(data->work_var_count-1)*data->sample_count);
             for( int i = 0; i < n; i++ )
             {
                 // save original categorical responses {0,1}, convert them to {-1,1}
@@ -1429,7 +2727,7 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
         else
         {
             int* labels = buf->data.i + data->data_root->buf_idx*length_buf_row +
-                data->data_root->offset + (data->work_var_count-1)*data->sample_count;
+                data->data_root->offset + (size_t)(data->work_var_count-1)*data->sample_count;
 
             for( int i = 0; i < n; i++ )
             {
@@ -1465,6 +2763,8 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
     }
     else
     {
+        WeightsUpdater updater( this, (CvCascadeBoostTree*)tree, fdata, step, sampleIdx );
+
         // at this moment, for all the samples that participated in the training of the most
         // recent weak classifier we know the responses. For other samples we need to compute them
         if( have_subsample )
@@ -1473,11 +2773,7 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
             cvXorS( subsample_mask, cvScalar(1.), subsample_mask );
 
             // run tree through all the non-processed samples
-            for( int i = 0; i < n; i++ )
-                if( subsample_mask->data.ptr[i] )
-                {
-                    weak_eval->data.db[i] = ((CvCascadeBoostTree*)tree)->predict( i )->value;
-                }
+            updater.run( WeightsUpdater::PREDICT );
         }
 
         // now update weights and other parameters for each type of boosting
@@ -1490,50 +2786,30 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
             //   w_i *= exp(C*(f(x_i) != y_i))
 
             double C, err = 0.;
-            double scale[] = { 1., 0. };
-
-            for( int i = 0; i < n; i++ )
-            {
-                double w = weights->data.db[i];
-                sumW += w;
-                err += w*(weak_eval->data.db[i] != orig_response->data.i[i]);
-            }
+            sumW = updater.run( WeightsUpdater::DISCRETE_ERROR, &err );
 
             if( sumW != 0 )
                 err /= sumW;
             C = err = -logRatio( err );
-            scale[1] = exp(err);
+            updater.scale[0] = 1.;
+            updater.scale[1] = exp(err);
 
-            sumW = 0;
-            for( int i = 0; i < n; i++ )
-            {
-                double w = weights->data.db[i]*
-                    scale[weak_eval->data.db[i] != orig_response->data.i[i]];
-                sumW += w;
-                weights->data.db[i] = w;
-            }
+            sumW = updater.run( WeightsUpdater::DISCRETE_UPDATE );
 
             tree->scale( C );
         }
-        else if( params.boost_type == REAL )
+        else if( params.boost_type == REAL || params.boost_type == GENTLE )
         {
             // Real AdaBoost:
             //   weak_eval[i] = f(x_i) = 0.5*log(p(x_i)/(1-p(x_i))), p(x_i)=P(y=1|x_i)
             //   w_i *= exp(-y_i*f(x_i))
+            // Gentle AdaBoost:
+            //   weak_eval[i] = f(x_i) in [-1,1]
+            //   w_i *= exp(-y_i*f(x_i))
 
-            for( int i = 0; i < n; i++ )
-                weak_eval->data.db[i] *= -orig_response->data.i[i];
-
-            cvExp( weak_eval, weak_eval );
-
-            for( int i = 0; i < n; i++ )
-            {
-                double w = weights->data.db[i]*weak_eval->data.db[i];
-                sumW += w;
-                weights->data.db[i] = w;
-            }
+            sumW = updater.run( WeightsUpdater::EXP_UPDATE );
         }
-        else if( params.boost_type == LOGIT )
+        else
         {
             // LogitBoost:
             //   weak_eval[i] = f(x_i) in [-z_max,z_max]
@@ -1544,79 +2820,154 @@ void CvCascadeBoost::update_weights( CvBoostTree* tree )
             //   w_i = p(x_i)*1(1 - p(x_i))
             //   z_i = ((y_i+1)/2 - p(x_i))/(p(x_i)*(1 - p(x_i)))
             //   store z_i to the data->data_root as the new target responses
+            assert( params.boost_type == LOGIT );
 
-            const double lbWeightThresh = FLT_EPSILON;
-            const double lbZMax = 10.;
-
-            for( int i = 0; i < n; i++ )
-            {
-                double s = sum_response->data.db[i] + 0.5*weak_eval->data.db[i];
-                sum_response->data.db[i] = s;
-                weak_eval->data.db[i] = -2*s;
-            }
-
-            cvExp( weak_eval, weak_eval );
-
-            for( int i = 0; i < n; i++ )
-            {
-                double p = 1./(1. + weak_eval->data.db[i]);
-                double w = p*(1 - p), z;
-                w = MAX( w, lbWeightThresh );
-                weights->data.db[i] = w;
-                sumW += w;
-                if( orig_response->data.i[i] > 0 )
-                {
-                    z = 1./p;
-                    fdata[sampleIdx[i]*step] = (float)min(z, lbZMax);
-                }
-                else
-                {
-                    z = 1./(1-p);
-                    fdata[sampleIdx[i]*step] = (float)-min(z, lbZMax);
-                }
-            }
+            sumW = updater.run( WeightsUpdater::LOGIT_UPDATE );
         }
-        else
+
+        // renormalize weights
+        if( sumW > FLT_EPSILON )
         {
-            // Gentle AdaBoost:
-            //   weak_eval[i] = f(x_i) in [-1,1]
-            //   w_i *= exp(-y_i*f(x_i))
-            assert( params.boost_type == GENTLE );
+            updater.scale[0] = 1./sumW;
+            updater.run( WeightsUpdater::NORMALIZE );
+        }
+    }
+}
 
-            for( int i = 0; i < n; i++ )
-                weak_eval->data.db[i] *= -orig_response->data.i[i];
+// Draws the features searched by the next tree. The precalculated ones are taken first,
+// their values or sorted indices need not be computed at every node.
+void CvCascadeBoost::sampleFeatures()
+{
+    CvCascadeBoostTrainData* cdata = (CvCascadeBoostTrainData*)data;
+    int varCount = data->var_count;
+    if( featureFraction >= 1.F )
+    {
+        cdata->activeVars.clear();
+        return;
+    }
 
-            cvExp( weak_eval, weak_eval );
+    int count = max( 1, cvRound( varCount*featureFraction ) );
+    int numPrecalc = !cdata->binCodes.empty() ? varCount :
+        min( varCount, data->cat_var_count ? cdata->numPrecalcVal : max( cdata->numPrecalcVal, cdata->numPrecalcIdx ) );
+    vector<int> vars( varCount );
+    for( int vi = 0; vi < varCount; vi++ )
+        vars[vi] = vi;
+    cdata->activeVars.assign( varCount, (uchar)0 );
+
+    // the remaining features keep at least their proportional share, so that every feature
+    // can be searched, the precalculated ones fill the rest of the subset
+    int numOther = varCount - numPrecalc;
+    int otherCount = numOther ? max( 1, (int)((int64)count*numOther/varCount) ) : 0;
+    otherCount = max( otherCount, count - numPrecalc );
+    int precalcCount = count - otherCount;
+    if( weak->total == 0 )
+        cout << "Feature subspace split: " << precalcCount << " of " << numPrecalc << " precalculated, "
+             << otherCount << " of " << numOther << " others" << endl;
+
+    // partial shuffles of [0, numPrecalc) and of the remaining features
+    for( int k = 0; k < precalcCount; k++ )
+    {
+        std::swap( vars[k], vars[k + rng.uniform( 0, numPrecalc - k )] );
+        cdata->activeVars[vars[k]] = 1;
+    }
+    for( int k = numPrecalc; k < numPrecalc + otherCount; k++ )
+    {
+        std::swap( vars[k], vars[k + rng.uniform( 0, varCount - k )] );
+        cdata->activeVars[vars[k]] = 1;
+    }
+}
 
-            for( int i = 0; i < n; i++ )
-            {
-                double w = weights->data.db[i] * weak_eval->data.db[i];
-                weights->data.db[i] = w;
-                sumW += w;
-            }
-        }
+struct GossWeightGreater
+{
+    GossWeightGreater( const double* _weights ) : weights( _weights ) {}
+    bool operator()( int a, int b ) const
+    {
+        return weights[a] > weights[b] || (weights[a] == weights[b] && a < b);
     }
+    const double* weights;
+};
 
-    // renormalize weights
-    if( sumW > FLT_EPSILON )
+// Gradient-based one-side sampling: the samples left by the weight trimming with the largest
+// weights are all kept, the others are drawn at random and their weights are scaled up by the
+// inverse of the drawn fraction so the weighted sums of the tree stay unbiased. The scaled
+// weights are restored by update_weights, the next trees start from the boosting weights.
+void CvCascadeBoost::trim_weights()
+{
+    CvBoost::trim_weights();
+    if( gossTopRate <= 0 )
+        return;
+
+    int n = data->sample_count;
+    uchar* mask = subsample_mask->data.ptr;
+    double* w = weights->data.db;
+    // without trimming CvBoost leaves the mask of the previous tree as it is
+    if( params.weight_trim_rate <= 0. || params.weight_trim_rate >= 1. )
+        memset( mask, 1, n );
+    vector<int> active;
+    for( int i = 0; i < n; i++ )
+        if( mask[i] )
+            active.push_back( i );
+
+    int count = (int)active.size();
+    int topCount = cvRound( count*gossTopRate ), otherCount = cvRound( count*gossOtherRate );
+    if( otherCount <= 0 || topCount + otherCount >= count )
+        return;
+
+    nth_element( active.begin(), active.begin() + topCount, active.end(), GossWeightGreater(w) );
+    // drawn in index order, the result does not depend on the nth_element implementation
+    sort( active.begin() + topCount, active.end() );
+    for( int i = topCount; i < count; i++ )
+        mask[active[i]] = 0;
+
+    double scale = (double)(count - topCount)/otherCount;
+    for( int k = 0; k < otherCount; k++ )
     {
-        sumW = 1./sumW;
-        for( int i = 0; i < n; ++i )
-            weights->data.db[i] *= sumW;
+        int j = topCount + k + rng.uniform( 0, count - topCount - k );
+        std::swap( active[topCount + k], active[j] );
+        int si = active[topCount + k];
+        mask[si] = 1;
+        gossWeights.push_back( std::make_pair( si, w[si] ) );
+        w[si] *= scale;
     }
+    have_subsample = true;
 }
 
+struct StageScoreUpdater : ParallelLoopBody
+{
+    StageScoreUpdater( const CvCascadeBoostTree* _tree, double* _scores, bool _exactValues = false )
+    {
+        tree = _tree;
+        scores = _scores;
+        exactValues = _exactValues;
+    }
+    void operator()( const Range& range ) const
+    {
+        for( int i = range.start; i < range.end; i++ )
+            scores[i] += tree->predict( i, exactValues )->value;
+    }
+    const CvCascadeBoostTree* tree;
+    double* scores;
+    bool exactValues;
+};
+
 bool CvCascadeBoost::isErrDesired()
 {
     int sCount = data->sample_count,
         numPos = 0, numNeg = 0, numFalse = 0, numPosTrue = 0;
     vector<float> eval(sCount);
 
+    // only the trees added since the last check are run, the scores keep the sums of the others
+    for( ; scoredCount < weak->total; scoredCount++ )
+    {
+        CvCascadeBoostTree* tree = *((CvCascadeBoostTree**)cvGetSeqElem( weak, scoredCount ));
+        parallel_for_( Range(0, sCount), StageScoreUpdater(tree, &scores[0]) );
+    }
+
     for( int i = 0; i < sCount; i++ )
         if( ((CvCascadeBoostTrainData*)data)->featureEvaluator->getCls( i ) == 1.0F )
-            eval[numPos++] = predict( i, true );
-    icvSortFlt( &eval[0], numPos, 0 );
+            eval[numPos++] = (float)scores[i];
     int thresholdIdx = (int)((1.0F - minHitRate) * numPos);
+    std::nth_element( eval.begin(), eval.begin() + thresholdIdx, eval.begin() + numPos );
     threshold = eval[ thresholdIdx ];
     numPosTrue = numPos - thresholdIdx;
     for( int i = thresholdIdx - 1; i >= 0; i--)
@@ -1629,7 +2980,7 @@ bool CvCascadeBoost::isErrDesired()
         if( ((CvCascadeBoostTrainData*)data)->featureEvaluator->getCls( i ) == 0.0F )
         {
             numNeg++;
-            if( predict( i ) )
+            if( !(scores[i] < threshold - CV_THRESHOLD_EPS) )
                 numFalse++;
         }
     }
@@ -1644,6 +2995,47 @@ bool CvCascadeBoost::isErrDesired()
     return falseAlarm <= maxFalseAlarm;
 }
 
+// Re-scores the stage with the exact feature values and prints how the quantized value cache
+// moved the hit rate and the false alarm rate at the chosen threshold.
+void CvCascadeBoost::reportQuantizationEffect()
+{
+    CvCascadeBoostTrainData* cdata = (CvCascadeBoostTrainData*)data;
+    if( cdata->quantError.empty() )
+        return;
+
+    int sCount = data->sample_count;
+    vector<double> quantScores( sCount, 0. ), exactScores( sCount, 0. );
+    for( int wi = 0; wi < weak->total; wi++ )
+    {
+        CvCascadeBoostTree* tree = *((CvCascadeBoostTree**)cvGetSeqElem( weak, wi ));
+        parallel_for_( Range(0, sCount), StageScoreUpdater(tree, &quantScores[0]) );
+        parallel_for_( Range(0, sCount), StageScoreUpdater(tree, &exactScores[0], true) );
+    }
+
+    int numPos = 0, numNeg = 0, posQuant = 0, posExact = 0, negQuant = 0, negExact = 0;
+    for( int i = 0; i < sCount; i++ )
+    {
+        int q = !(quantScores[i] < threshold - CV_THRESHOLD_EPS);
+        int e = !(exactScores[i] < threshold - CV_THRESHOLD_EPS);
+        if( cdata->featureEvaluator->getCls( i ) == 1.0F )
+        {
+            numPos++;
+            posQuant += q;
+            posExact += e;
+        }
+        else
+        {
+            numNeg++;
+            negQuant += q;
+            negExact += e;
+        }
+    }
+    float hrQuant = (float)posQuant/max( numPos, 1 ), hrExact = (float)posExact/max( numPos, 1 );
+    float faQuant = (float)negQuant/max( numNeg, 1 ), faExact = (float)negExact/max( numNeg, 1 );
+    cout << "Exact feature values: HR " << hrExact << " (" << showpos << hrExact - hrQuant << noshowpos
+         << "), FA " << faExact << " (" << showpos << faExact - faQuant << noshowpos << ")" << endl;
+}
+
 void CvCascadeBoost::write( FileStorage &fs, const Mat& featureMap ) const
 {
 //    char cmnt[30];
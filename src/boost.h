@@ -2,12 +2,27 @@
 #define _OPENCV_BOOST_H_
 
 #include "traincascade_features.h"
+#include "scratchfile.h"
 #include "ml.h"
+#include <map>
 
 struct CvCascadeBoostParams : CvBoostParams	//δָ̳͵ĲĬϵpublicʽ̳
 {
+    enum { FLOAT_CACHE = 0, QUANT16_CACHE = 1 };
+    enum { SORTED_SPLITS = 0, HIST_SPLITS = 1 };
+
     float minHitRate;
     float maxFalseAlarm;
+    int valCacheType; // storage of precalculated feature values
+    int splitFinder; // search of the ordered splits, on presorted values or on binned histograms
+    int maxBins; // number of bins per feature of the histogram split finder
+    float gossTopRate; // one-side sampling: fraction of the active samples kept by weight, 0 to disable
+    float gossOtherRate; // one-side sampling: fraction drawn at random from the remaining ones
+    int seed; // random number generator seed of the sampling
+    float featureFraction; // fraction of the features searched by each weak tree
+    std::string swapDir; // scratch directory for values and indices beyond the buffer sizes, not saved
+    bool reuseSamples; // keep precalculated values of samples that stay in the next stage, not saved
+    bool levelGrowth; // grow the trees a level at a time with the histogram splits, not saved
 
     CvCascadeBoostParams();
     CvCascadeBoostParams( int _boostType, float _minHitRate, float _maxFalseAlarm,
@@ -20,19 +35,40 @@ struct CvCascadeBoostParams : CvBoostParams	//δָ
     virtual bool scanAttr( const std::string prmName, const std::string val);
 };
 
+// Precalculated data handed from one stage to the next, samples are matched by identity
+struct CvCascadeSampleCache
+{
+    std::vector<int64> ids;       // identities of the samples being set, filled by the caller
+    std::vector<int64> cachedIds; // identities of the columns of values
+    cv::Mat values;               // in-memory valCache rows of the previous stage
+    cv::Mat sortedIdx;            // sorted root indices of the previous stage (CV_32SC1)
+
+    void clear();
+};
+
 struct CvCascadeBoostTrainData : CvDTreeTrainData
 {
     CvCascadeBoostTrainData( const CvFeatureEvaluator* _featureEvaluator,
-                             const CvDTreeParams& _params );
+                             const CvCascadeBoostParams& _params );
     CvCascadeBoostTrainData( const CvFeatureEvaluator* _featureEvaluator,
                              int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize,
-                             const CvDTreeParams& _params = CvDTreeParams() );
+                             const CvCascadeBoostParams& _params = CvCascadeBoostParams(),
+                             CvCascadeSampleCache* _sampleCache = 0 );
     virtual void setData( const CvFeatureEvaluator* _featureEvaluator,
                           int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize,
-                          const CvDTreeParams& _params=CvDTreeParams() );
+                          const CvCascadeBoostParams& _params = CvCascadeBoostParams(),
+                          CvCascadeSampleCache* _sampleCache = 0 );
     void precalculate();
+    void quantizeFeatures( int maxBins, const std::string& swapDir );
+    void saveSampleCache();
+
+    // valCache access, hides the storage type and the tier of the cached values
+    uchar* cachedRow( int vi ) const;
+    float getCachedVal( int vi, int si ) const;
+    void setCachedRow( int vi, const float* vals );
 
     virtual CvDTreeNode* subsample_data( const CvMat* _subsample_idx );
+    void copySortedIdx( CvDTreeNode* n, int vi, int* dst );
 
     virtual const int* get_class_labels( CvDTreeNode* n, int* labelsBuf );
     virtual const int* get_cv_labels( CvDTreeNode* n, int* labelsBuf);
@@ -45,28 +81,78 @@ struct CvCascadeBoostTrainData : CvDTreeTrainData
     virtual void free_train_data();
 
     const CvFeatureEvaluator* featureEvaluator;
-    cv::Mat valCache; // precalculated feature values (CV_32FC1)
+    cv::Mat valCache; // precalculated feature values (CV_32FC1, CV_16UC1 when quantized, CV_8UC1 for categorical codes)
+    std::vector<float> valScale, valShift; // per feature dequantization, value = shift + scale*code
+    std::vector<float> quantError; // per feature maximal quantization error of the current stage
+    cv::Mat swapValCache; // rows of valCache past the memory budget, mapped from valSwap
+    CvScratchFile valSwap, bufSwap; // bufSwap backs buf when the sorted indices do not fit the budget
+    CvCascadeSampleCache* sampleCache;
+    cv::Mat binCodes; // histogram splits: bin of every sample per feature (CV_8UC1), empty for the sorted splits
+    cv::Mat binThresholds; // split values between the adjacent bins of each feature (CV_32FC1)
+    std::vector<int> binCounts; // number of bins per feature
+    CvScratchFile binSwap; // backs binCodes when a scratch directory is given
+    size_t histBufSize; // memory for the node histograms kept for the sibling subtraction
+    bool levelGrowth; // the splits of all nodes of a tree level are found in one pass over the bin codes
+    std::vector<uchar> activeVars; // features searched by the current tree, empty for all of them
+    CvDTreeNode* viewRoot; // subsample root reading the sorted indices of data_root through viewIdx
+    std::vector<int> viewIdx; // position of every sample in viewRoot, -1 for the inactive ones
     CvMat _resp; // for casting
     int numPrecalcVal, numPrecalcIdx;
 };
 
+inline uchar* CvCascadeBoostTrainData::cachedRow( int vi ) const
+{
+    return vi < valCache.rows ? (uchar*)valCache.ptr( vi ) : (uchar*)swapValCache.ptr( vi - valCache.rows );
+}
+
+inline float CvCascadeBoostTrainData::getCachedVal( int vi, int si ) const
+{
+    const uchar* row = cachedRow( vi );
+    if( valCache.depth() == CV_8U )
+        return row[si];
+    if( valCache.depth() == CV_16U )
+        return valShift[vi] + valScale[vi]*((const ushort*)row)[si];
+    return ((const float*)row)[si];
+}
+
 class CvCascadeBoostTree : public CvBoostTree
 {
+    friend struct BestSplitFinder;
 public:
-    virtual CvDTreeNode* predict( int sampleIdx ) const;
+    // exactValues: the features are computed by the evaluator instead of read from the value cache
+    virtual CvDTreeNode* predict( int sampleIdx, bool exactValues = false ) const;
     void write( cv::FileStorage &fs, const cv::Mat& featureMap );
     void read( const cv::FileNode &node, CvBoost* _ensemble, CvDTreeTrainData* _data );
     void markFeaturesInMap( cv::Mat& featureMap );
 protected:
+    virtual void try_split_node( CvDTreeNode* n );
+    virtual CvDTreeSplit* find_best_split( CvDTreeNode* n );
+    virtual CvDTreeSplit* find_split_cat_class( CvDTreeNode* n, int vi, float init_quality = 0,
+                                                CvDTreeSplit* _split = 0, uchar* ext_buf = 0 );
+    virtual CvDTreeSplit* find_split_cat_reg( CvDTreeNode* n, int vi, float init_quality = 0,
+                                              CvDTreeSplit* _split = 0, uchar* ext_buf = 0 );
+    CvDTreeSplit* findByteCatSplit( CvDTreeNode* n, int vi, float init_quality,
+                                    CvDTreeSplit* _split, uchar* ext_buf );
+    virtual double calc_node_dir( CvDTreeNode* n );
     virtual void split_node_data( CvDTreeNode* n );
+    void getHistSamples( CvDTreeNode* n, std::vector<int>& sampleIdx,
+                         std::vector<double>& sum0, std::vector<double>& sum1 );
+    void growLevels( CvDTreeNode* root );
+    bool canSplitNode( CvDTreeNode* n );
+    void setLeaf( CvDTreeNode* n );
+    void findLevelSplits( const std::vector<CvDTreeNode*>& nodes, std::vector<CvDTreeSplit*>& splits );
+
+    std::map<CvDTreeNode*, cv::Mat> nodeHists; // histograms kept to get the ones of the siblings by subtraction
 };
 
 class CvCascadeBoost : public CvBoost
 {
+    friend struct WeightsUpdater;
 public:
     virtual bool train( const CvFeatureEvaluator* _featureEvaluator,
                         int _numSamples, int _precalcValBufSize, int _precalcIdxBufSize,
-                        const CvCascadeBoostParams& _params=CvCascadeBoostParams() );
+                        const CvCascadeBoostParams& _params=CvCascadeBoostParams(),
+                        CvCascadeSampleCache* _sampleCache = 0 );
     virtual float predict( int sampleIdx, bool returnSum = false ) const;
 
     float getThreshold() const { return threshold; }
@@ -77,10 +163,19 @@ public:
 protected:
     virtual bool set_params( const CvBoostParams& _params );
     virtual void update_weights( CvBoostTree* tree );
+    virtual void trim_weights();
     virtual bool isErrDesired();
+    void sampleFeatures();
+    void reportQuantizationEffect();
 
     float threshold;
     float minHitRate, maxFalseAlarm;
+    float gossTopRate, gossOtherRate;
+    float featureFraction;
+    cv::RNG rng;
+    std::vector<std::pair<int, double> > gossWeights; // weights scaled for the last tree and their values
+    std::vector<double> scores; // sums of the trees [0, scoredCount) for every sample
+    int scoredCount;
 };
 
 #endif
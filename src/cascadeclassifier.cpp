@@ -8,7 +8,7 @@ using namespace std;
 using namespace cv;
 
 static const char* stageTypes[] = { CC_BOOST };
-static const char* featureTypes[] = { CC_HAAR, CC_LBP, CC_HOG };
+static const char* featureTypes[] = { CC_HAAR, CC_LBP, CC_HOG, CC_NPD };
 
 CvCascadeParams::CvCascadeParams() : stageType( defaultStageType ),
     featureType( defaultFeatureType ), winSize( cvSize(24, 24) )
@@ -31,6 +31,7 @@ void CvCascadeParams::write( FileStorage &fs ) const
     string featureTypeStr = featureType == CvFeatureParams::HAAR ? CC_HAAR :
                             featureType == CvFeatureParams::LBP ? CC_LBP :
                             featureType == CvFeatureParams::HOG ? CC_HOG :
+                            featureType == CvFeatureParams::NPD ? CC_NPD :
                             0;
     CV_Assert( !stageTypeStr.empty() );
     fs << CC_FEATURE_TYPE << featureTypeStr;
@@ -58,6 +59,7 @@ bool CvCascadeParams::read( const FileNode &node )
     featureType = !featureTypeStr.compare( CC_HAAR ) ? CvFeatureParams::HAAR :
                   !featureTypeStr.compare( CC_LBP ) ? CvFeatureParams::LBP :
                   !featureTypeStr.compare( CC_HOG ) ? CvFeatureParams::HOG :
+                  !featureTypeStr.compare( CC_NPD ) ? CvFeatureParams::NPD :
                   -1;
     if (featureType == -1)
         return false;
@@ -171,6 +173,14 @@ bool CvCascadeClassifier::train( const string _cascadeDirName,
         featureEvaluator->init( (CvFeatureParams*)featureParams, numPos + numNeg, cascadeParams.winSize );
         stageClassifiers.reserve( numStages );	//ԤһnumStagesԪصڴռ䣬size()Ϊ0
     }
+    // options of this run only, they are not part of the saved parameters
+    stageParams->swapDir = _stageParams.swapDir;
+    stageParams->reuseSamples = _stageParams.reuseSamples;
+    stageParams->levelGrowth = _stageParams.levelGrowth;
+    sampleCache.clear();
+    sampleCache.ids.assign( numPos + numNeg, 0 );
+    numNegIds = 0;
+
     cout << "PARAMETERS:" << endl;
     cout << "cascadeDirName: " << _cascadeDirName << endl;
     cout << "vecFileName: " << _posFilename << endl;
@@ -215,7 +225,8 @@ bool CvCascadeClassifier::train( const string _cascadeDirName,
         CvCascadeBoost* tempStage = new CvCascadeBoost;
         bool isStageTrained = tempStage->train( (CvFeatureEvaluator*)featureEvaluator,
                                                 curNumSamples, _precalcValBufSize, _precalcIdxBufSize,
-                                                *((CvCascadeBoostParams*)stageParams) );
+                                                *((CvCascadeBoostParams*)stageParams),
+                                                stageParams->reuseSamples ? &sampleCache : 0 );
         cout << "END>" << endl;
 
         if(!isStageTrained)
@@ -327,6 +338,8 @@ int CvCascadeClassifier::fillPassedSamples( int first, int count, bool isPositiv
             featureEvaluator->setImage( img, isPositive ? 1 : 0, i );	//imgĻͼϢ  //˲CvHaarEvaluatorsetImage
             if( predict( i ) == 1.0F )	//ֻܲͨǰn-1ǿΪʵȡ
             {
+                // the positives are read from the start of the vec file at every stage
+                sampleCache.ids[i] = isPositive ? consumed - 1 : -(++numNegIds);
                 getcount++;
                 printf("%s current samples: %d\r", isPositive ? "POS":"NEG", getcount);
                 break;
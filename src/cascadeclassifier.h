@@ -6,6 +6,7 @@
 #include "haarfeatures.h"
 #include "lbpfeatures.h"
 #include "HOGfeatures.h" //new
+#include "npdfeatures.h"
 #include "boost.h"
 #include "cv.h"
 #include "cxcore.h"
@@ -34,6 +35,17 @@
 #define CC_TRIM_RATE        "weightTrimRate"
 #define CC_MAX_DEPTH        "maxDepth"
 #define CC_WEAK_COUNT       "maxWeakCount"
+#define CC_VAL_CACHE        "valCache"
+#define CC_VAL_CACHE_FLOAT  "FLOAT"
+#define CC_VAL_CACHE_Q16    "Q16"
+#define CC_SPLIT_FINDER     "splitFinder"
+#define CC_SPLIT_SORTED     "SORTED"
+#define CC_SPLIT_HIST       "HIST"
+#define CC_MAX_BINS         "maxBins"
+#define CC_GOSS_TOP_RATE    "gossTopRate"
+#define CC_GOSS_OTHER_RATE  "gossOtherRate"
+#define CC_SEED             "seed"
+#define CC_FEATURE_FRACTION "featureFraction"
 #define CC_STAGE_THRESHOLD  "stageThreshold"
 #define CC_WEAK_CLASSIFIERS "weakClassifiers"
 #define CC_INTERNAL_NODES   "internalNodes"
@@ -43,6 +55,13 @@
 #define CC_FEATURE_PARAMS "featureParams"
 #define CC_MAX_CAT_COUNT  "maxCatCount"
 #define CC_FEATURE_SIZE   "featSize"
+#define CC_LAZY_DECODING  "lazyDecoding"
+#define CC_POS_STRIDE     "posStride"
+#define CC_SIZE_STRIDE    "sizeStride"
+#define CC_MIN_RECT_SIZE  "minRectSize"
+#define CC_MAX_RECT_SIZE  "maxRectSize"
+#define CC_MAX_ASPECT_RATIO "maxAspectRatio"
+#define CC_DEDUP_FEATURES "dedupFeatures"
 
 #define CC_HAAR        "HAAR"
 #define CC_MODE        "mode"
@@ -56,6 +75,12 @@
 #define CC_RECT "rect"
 
 #define CC_HOG "HOG"
+#define CC_HOG_STORAGE      "storage"
+#define CC_HOG_STORAGE_FULL "FULL"
+#define CC_HOG_STORAGE_GRID "GRID"
+
+#define CC_NPD        "NPD"
+#define CC_NPD_POINTS "points"
 
 #ifdef _WIN32
 #define TIME( arg ) (((double) clock()) / CLOCKS_PER_SEC)
@@ -121,6 +146,8 @@ private:
     CvCascadeImageReader imgReader;
     int numStages, curNumSamples;
     int numPos, numNeg;
+    CvCascadeSampleCache sampleCache; // values of the last stage, ids of the current samples
+    int64 numNegIds; // negatives get running ids, positives their index in the vec file
 };
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "traincascade_features.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 
 using namespace std;
 using namespace cv;
@@ -21,6 +22,17 @@ float calcNormFactor( const Mat& sum, const Mat& sqSum )
     return (float) sqrt( (double) (area * valSqSum - (double)valSum * valSum) );
 }
 
+float calcWindowIntegrals( const Mat& img, Mat& sum, Mat& tilted )
+{
+    CV_Assert( img.type() == CV_8UC1 && sum.type() == CV_32SC1 &&
+               sum.rows == img.rows + 1 && sum.cols == img.cols + 1 );
+    CV_Assert( tilted.empty() || (tilted.type() == CV_32SC1 &&
+               tilted.size() == sum.size() && tilted.step == sum.step) );
+    AutoBuffer<int> adiag( 2*(img.cols + 1) );
+    return getTrainKernels().windowIntegrals( img.data, img.step, img.cols, img.rows, (int*)sum.data,
+                                              tilted.empty() ? 0 : (int*)tilted.data, sum.step1(), adiag );
+}
+
 CvParams::CvParams() : name( "params" ) {}
 void CvParams::printDefaults() const
 { cout << "--" << name << "--" << endl; }
@@ -30,7 +42,9 @@ bool CvParams::scanAttr( const string, const string ) { return false; }
 
 //---------------------------- FeatureParams --------------------------------------
 
-CvFeatureParams::CvFeatureParams() : maxCatCount( 0 ), featSize( 1 )
+CvFeatureParams::CvFeatureParams() : maxCatCount( 0 ), featSize( 1 ), lazyDecoding( 0 ),
+    posStride( 1 ), sizeStride( 1 ), minRectSize( 1 ), maxRectSize( 0 ),
+    maxAspectRatio( 0.f ), dedupFeatures( 0 )
 {
     name = CC_FEATURE_PARAMS;
 }
@@ -39,12 +53,26 @@ void CvFeatureParams::init( const CvFeatureParams& fp )
 {
     maxCatCount = fp.maxCatCount;
     featSize = fp.featSize;
+    lazyDecoding = fp.lazyDecoding;
+    posStride = fp.posStride;
+    sizeStride = fp.sizeStride;
+    minRectSize = fp.minRectSize;
+    maxRectSize = fp.maxRectSize;
+    maxAspectRatio = fp.maxAspectRatio;
+    dedupFeatures = fp.dedupFeatures;
 }
 
 void CvFeatureParams::write( FileStorage &fs ) const
 {
     fs << CC_MAX_CAT_COUNT << maxCatCount;
     fs << CC_FEATURE_SIZE << featSize;
+    fs << CC_LAZY_DECODING << lazyDecoding;
+    fs << CC_POS_STRIDE << posStride;
+    fs << CC_SIZE_STRIDE << sizeStride;
+    fs << CC_MIN_RECT_SIZE << minRectSize;
+    fs << CC_MAX_RECT_SIZE << maxRectSize;
+    fs << CC_MAX_ASPECT_RATIO << maxAspectRatio;
+    fs << CC_DEDUP_FEATURES << dedupFeatures;
 }
 
 //ȡmaxCatCount,featSize
@@ -54,7 +82,78 @@ bool CvFeatureParams::read( const FileNode &node )
         return false;
     maxCatCount = node[CC_MAX_CAT_COUNT];
     featSize = node[CC_FEATURE_SIZE];
-    return ( maxCatCount >= 0 && featSize >= 1 );
+    // the pool options are absent in files written before they existed
+    cv::read( node[CC_LAZY_DECODING], lazyDecoding, 0 );
+    cv::read( node[CC_POS_STRIDE], posStride, 1 );
+    cv::read( node[CC_SIZE_STRIDE], sizeStride, 1 );
+    cv::read( node[CC_MIN_RECT_SIZE], minRectSize, 1 );
+    cv::read( node[CC_MAX_RECT_SIZE], maxRectSize, 0 );
+    cv::read( node[CC_MAX_ASPECT_RATIO], maxAspectRatio, 0.f );
+    cv::read( node[CC_DEDUP_FEATURES], dedupFeatures, 0 );
+    return ( maxCatCount >= 0 && featSize >= 1 && checkPoolParams() );
+}
+
+void CvFeatureParams::printDefaults() const
+{
+    CvParams::printDefaults();
+    cout << "  [-lazyDecoding <0(default) | 1>] (HAAR, LBP)" << endl;
+    cout << "  [-posStride <feature_position_stride = " << posStride << ">]" << endl;
+    cout << "  [-sizeStride <feature_cell_size_stride = " << sizeStride << ">]" << endl;
+    cout << "  [-minRectSize <min_feature_cell_side = " << minRectSize << ">]" << endl;
+    cout << "  [-maxRectSize <max_feature_cell_side = " << maxRectSize << " (no limit)>]" << endl;
+    cout << "  [-maxAspectRatio <max_feature_cell_aspect_ratio = " << maxAspectRatio << " (no limit)>]" << endl;
+    cout << "  [-dedupFeatures <0(default) | 1>] (HAAR, not with lazyDecoding)" << endl;
+}
+
+void CvFeatureParams::printAttrs() const
+{
+    CvParams::printAttrs();
+    cout << "lazyDecoding: " << lazyDecoding << endl;
+    cout << "posStride: " << posStride << endl;
+    cout << "sizeStride: " << sizeStride << endl;
+    cout << "minRectSize: " << minRectSize << endl;
+    cout << "maxRectSize: " << maxRectSize << endl;
+    cout << "maxAspectRatio: " << maxAspectRatio << endl;
+    cout << "dedupFeatures: " << dedupFeatures << endl;
+}
+
+bool CvFeatureParams::scanAttr( const string prmName, const string val )
+{
+    if( !prmName.compare( "-lazyDecoding" ) )
+        lazyDecoding = atoi( val.c_str() );
+    else if( !prmName.compare( "-posStride" ) )
+        posStride = atoi( val.c_str() );
+    else if( !prmName.compare( "-sizeStride" ) )
+        sizeStride = atoi( val.c_str() );
+    else if( !prmName.compare( "-minRectSize" ) )
+        minRectSize = atoi( val.c_str() );
+    else if( !prmName.compare( "-maxRectSize" ) )
+        maxRectSize = atoi( val.c_str() );
+    else if( !prmName.compare( "-maxAspectRatio" ) )
+        maxAspectRatio = (float) atof( val.c_str() );
+    else if( !prmName.compare( "-dedupFeatures" ) )
+        dedupFeatures = atoi( val.c_str() );
+    else
+        return CvParams::scanAttr( prmName, val );
+    return checkPoolParams();
+}
+
+bool CvFeatureParams::checkPoolParams() const
+{
+    return ( lazyDecoding == 0 || lazyDecoding == 1 ) &&
+           posStride >= 1 && sizeStride >= 1 && minRectSize >= 1 &&
+           maxRectSize >= 0 && ( maxAspectRatio == 0.f || maxAspectRatio >= 1.f ) &&
+           ( dedupFeatures == 0 || dedupFeatures == 1 ) &&
+           !( lazyDecoding && dedupFeatures ); // the decoded pool has no place to drop duplicates
+}
+
+bool CvFeatureParams::isCellSizeAllowed( int width, int height ) const
+{
+    return width % sizeStride == 0 && height % sizeStride == 0 &&
+           std::min( width, height ) >= minRectSize &&
+           ( maxRectSize == 0 || std::max( width, height ) <= maxRectSize ) &&
+           ( maxAspectRatio == 0.f ||
+             std::max( width, height ) <= maxAspectRatio * std::min( width, height ) );
 }
 
 Ptr<CvFeatureParams> CvFeatureParams::create( int featureType )
@@ -62,9 +161,76 @@ Ptr<CvFeatureParams> CvFeatureParams::create( int featureType )
     return featureType == HAAR ? Ptr<CvFeatureParams>(new CvHaarFeatureParams) :
         featureType == LBP ? Ptr<CvFeatureParams>(new CvLBPFeatureParams) :
         featureType == HOG ? Ptr<CvFeatureParams>(new CvHOGFeatureParams) :
+        featureType == NPD ? Ptr<CvFeatureParams>(new CvNPDFeatureParams) :
         Ptr<CvFeatureParams>();
 }
 
+//----------------------------- FeatureIndexRanges -------------------------------------
+
+// number of multiples of step in [lo, hi]
+static inline int gridCount( int lo, int hi, int step )
+{
+    int first = (lo + step - 1) / step * step;
+    return hi >= first ? (hi - first) / step + 1 : 0;
+}
+
+void CvFeatureIndexRanges::create( Size _winSize, const vector<Kind>& _kinds, const CvFeatureParams& params )
+{
+    winSize = _winSize;
+    kinds = _kinds;
+    posStride = params.posStride;
+    int W = winSize.width, H = winSize.height;
+    start.resize( kinds.size()*W*H + 1 );
+    int64 count = 0;
+    size_t pos = 0;
+    for( size_t k = 0; k < kinds.size(); k++ )
+        for( int dx = 1; dx <= W; dx++ )
+            for( int dy = 1; dy <= H; dy++ )
+            {
+                start[pos++] = (int)count;
+                if( !params.isCellSizeAllowed( dx, dy ) )
+                    continue;
+                int nx = gridCount( kinds[k].xlo*dy, W - kinds[k].xw*dx, posStride );
+                int ny = gridCount( 0, H - kinds[k].yhx*dx - kinds[k].yhy*dy, posStride );
+                count += (int64)nx*ny;
+                CV_Assert( count <= INT_MAX );
+            }
+    start[pos] = (int)count;
+}
+
+int CvFeatureIndexRanges::kindCount( int kind ) const
+{
+    int sizes = winSize.width*winSize.height;
+    for( size_t k = 0; k < kinds.size(); k++ )
+        if( kinds[k].id == kind )
+            return start[(k + 1)*sizes] - start[k*sizes];
+    return 0;
+}
+
+CvFeatureIndexRanges::Entry CvFeatureIndexRanges::decode( int idx ) const
+{
+    CV_DbgAssert( 0 <= idx && idx < total() );
+    int H = winSize.height, sizes = winSize.width*H;
+    // the last (kind, size) starting at or before idx; empty sizes share their start with the next one
+    int pos = (int)(upper_bound( start.begin(), start.end(), idx ) - start.begin()) - 1;
+    const Kind& k = kinds[pos / sizes];
+    Entry e;
+    e.kind = k.id;
+    e.dx = (pos % sizes) / H + 1;
+    e.dy = (pos % sizes) % H + 1;
+    int ny = gridCount( 0, H - k.yhx*e.dx - k.yhy*e.dy, posStride );
+    int r = idx - start[pos];
+    e.x = (k.xlo*e.dy + posStride - 1) / posStride * posStride + (r / ny) * posStride;
+    e.y = (r % ny) * posStride;
+    return e;
+}
+
+bool CvFeatureIndexRanges::contains( const Kind& k, Size winSize, int x, int y, int dx, int dy )
+{
+    return x >= k.xlo*dy && x + k.xw*dx <= winSize.width &&
+           y >= 0 && y + k.yhx*dx + k.yhy*dy <= winSize.height;
+}
+
 //------------------------------------- FeatureEvaluator ---------------------------------------
 
 void CvFeatureEvaluator::init(const CvFeatureParams *_featureParams,
@@ -72,6 +238,8 @@ void CvFeatureEvaluator::init(const CvFeatureParams *_featureParams,
 {
     CV_Assert(_maxSampleCount > 0);
     featureParams = (CvFeatureParams *)_featureParams;
+    // a bad stride would never end the pool loops
+    CV_Assert( featureParams->checkPoolParams() );
     winSize = _winSize;
     numFeatures = 0;
     cls.create( (int)_maxSampleCount, 1, CV_32FC1 );	//һnumPos + numNeg1Уһͨ32λfloat͵Mat
@@ -86,10 +254,17 @@ void CvFeatureEvaluator::setImage(const Mat &img, uchar clsLabel, int idx)
     cls.ptr<float>(idx)[0] = clsLabel;
 }
 
+void CvFeatureEvaluator::calcColumn( int featureIdx, int sampleCount, float* dst ) const
+{
+    for( int si = 0; si < sampleCount; si++ )
+        dst[si] = (*this)( featureIdx, si );
+}
+
 Ptr<CvFeatureEvaluator> CvFeatureEvaluator::create(int type)
 {
     return type == CvFeatureParams::HAAR ? Ptr<CvFeatureEvaluator>(new CvHaarEvaluator) :
         type == CvFeatureParams::LBP ? Ptr<CvFeatureEvaluator>(new CvLBPEvaluator) :
         type == CvFeatureParams::HOG ? Ptr<CvFeatureEvaluator>(new CvHOGEvaluator) :
+        type == CvFeatureParams::NPD ? Ptr<CvFeatureEvaluator>(new CvNPDEvaluator) :
         Ptr<CvFeatureEvaluator>();
 }
@@ -1,8 +1,12 @@
 #include "opencv2/core/core.hpp"
 #include "opencv2/core/internal.hpp"
 
+#include <map>
+#include <set>
+
 #include "haarfeatures.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 
 using namespace std;
 using namespace cv;
@@ -75,8 +79,7 @@ bool CvHaarFeatureParams::scanAttr( const string prmName, const string val)
             mode = !val.compare( CC_MODE_CORE ) ? CORE :		//#define CC_MODE_CORE   "CORE" 
                    !val.compare( CC_MODE_ALL ) ? ALL :			//enum { BASIC = 0, CORE = 1, ALL = 2 };
                    !val.compare( CC_MODE_BASIC ) ? BASIC : -1;
-            if (mode == -1)
-                return false;
+            return mode != -1;
         }
         return false;
     }
@@ -85,165 +88,281 @@ bool CvHaarFeatureParams::scanAttr( const string prmName, const string val)
 
 //--------------------- HaarFeatureEvaluator ----------------
 
+// geometry of every feature kind in generation order (see CvFeatureIndexRanges)
+// and the least mode that enables it
+static const CvFeatureIndexRanges::Kind haarKinds[] =
+{
+    {  0, 0, 2, 0, 1 }, // haar_x2
+    {  1, 0, 1, 0, 2 }, // haar_y2
+    {  2, 0, 3, 0, 1 }, // haar_x3
+    {  3, 0, 1, 0, 3 }, // haar_y3
+    {  4, 0, 4, 0, 1 }, // haar_x4
+    {  5, 0, 1, 0, 4 }, // haar_y4
+    {  6, 0, 2, 0, 2 }, // x2_y2
+    {  7, 0, 3, 0, 3 }, // x3_y3
+    {  8, 1, 2, 2, 1 }, // tilted haar_x2
+    {  9, 2, 1, 1, 2 }, // tilted haar_y2
+    { 10, 1, 3, 3, 1 }, // tilted haar_x3
+    { 11, 3, 1, 1, 3 }, // tilted haar_y3
+    { 12, 1, 4, 4, 1 }, // tilted haar_x4
+    { 13, 4, 1, 1, 4 }  // tilted haar_y4
+};
+static const int haarKindMode[] =
+{
+    CvHaarFeatureParams::BASIC, CvHaarFeatureParams::BASIC, CvHaarFeatureParams::BASIC, CvHaarFeatureParams::BASIC,
+    CvHaarFeatureParams::CORE, CvHaarFeatureParams::CORE, CvHaarFeatureParams::BASIC, CvHaarFeatureParams::CORE,
+    CvHaarFeatureParams::ALL, CvHaarFeatureParams::ALL, CvHaarFeatureParams::ALL,
+    CvHaarFeatureParams::ALL, CvHaarFeatureParams::ALL, CvHaarFeatureParams::ALL
+};
+static const int haarFirstTiltedKind = 8;
+
 void CvHaarEvaluator::init(const CvFeatureParams *_featureParams,
                            int _maxSampleCount, Size _winSize )
 {
     CV_Assert(_maxSampleCount > 0);
+    CvFeatureEvaluator::init( _featureParams, _maxSampleCount, _winSize );
     int cols = (_winSize.width + 1) * (_winSize.height + 1);
     sum.create((int)_maxSampleCount, cols, CV_32SC1);
-    tilted.create((int)_maxSampleCount, cols, CV_32SC1);
+    // the tilted integral is only stored and computed if the pool uses it
+    bool hasTilted = false;
+    if( featureParams->lazyDecoding )
+    {
+        for( int k = haarFirstTiltedKind; k < (int)(sizeof(haarKinds)/sizeof(haarKinds[0])); k++ )
+            hasTilted = hasTilted || ranges.kindCount( k ) > 0;
+    }
+    else
+    {
+        for( size_t fi = 0; fi < features.size() && !hasTilted; fi++ )
+            hasTilted = features[fi].tilted;
+    }
+    if( hasTilted )
+        tilted.create((int)_maxSampleCount, cols, CV_32SC1);
+    else
+        tilted.release();
     normfactor.create(1, (int)_maxSampleCount, CV_32FC1);
-    CvFeatureEvaluator::init( _featureParams, _maxSampleCount, _winSize );
+    packFeatures();
+}
+
+void CvHaarEvaluator::packFeatures()
+{
+    if( featureParams->lazyDecoding )
+    {
+        // nothing is stored per feature, operator() decodes the index
+        fastRects.release();
+        rectWeights.clear();
+        tiltedFlags.clear();
+        return;
+    }
+    int offset = winSize.width + 1;
+    int depth = (winSize.height + 1) * offset <= SHRT_MAX ? CV_16S : CV_32S;
+    fastRects.create( numFeatures, 4*CV_HAAR_FEATURE_MAX, depth );
+    rectWeights.resize( (size_t)numFeatures*CV_HAAR_FEATURE_MAX );
+    tiltedFlags.resize( numFeatures );
+    for( int fi = 0; fi < numFeatures; fi++ )
+    {
+        const Feature& f = features[fi];
+        int p[4*CV_HAAR_FEATURE_MAX];
+        f.getOffsets( offset, p );
+        for( int j = 0; j < 4*CV_HAAR_FEATURE_MAX; j++ )
+        {
+            if( depth == CV_16S )
+                fastRects.ptr<short>(fi)[j] = (short)p[j];
+            else
+                fastRects.ptr<int>(fi)[j] = p[j];
+        }
+        for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
+        {
+            schar wt = saturate_cast<schar>(f.rect[j].weight);
+            CV_Assert( wt == f.rect[j].weight );
+            rectWeights[fi*CV_HAAR_FEATURE_MAX + j] = wt;
+        }
+        tiltedFlags[fi] = f.tilted;
+    }
 }
 
 void CvHaarEvaluator::setImage(const Mat& img, uchar clsLabel, int idx)
 {
-    CV_DbgAssert( !sum.empty() && !tilted.empty() && !normfactor.empty() );
+    CV_DbgAssert( !sum.empty() && !normfactor.empty() );
     CvFeatureEvaluator::setImage( img, clsLabel, idx);
     Mat innSum(winSize.height + 1, winSize.width + 1, sum.type(), sum.ptr<int>((int)idx));
-    Mat innTilted(winSize.height + 1, winSize.width + 1, tilted.type(), tilted.ptr<int>((int)idx));
-    Mat innSqSum;
-    integral(img, innSum, innSqSum, innTilted);
-    normfactor.ptr<float>(0)[idx] = calcNormFactor( innSum, innSqSum );
+    Mat innTilted;
+    if( !tilted.empty() )
+        innTilted = Mat(winSize.height + 1, winSize.width + 1, tilted.type(), tilted.ptr<int>((int)idx));
+    normfactor.ptr<float>(0)[idx] = calcWindowIntegrals( img, innSum, innTilted );
+}
+
+float CvHaarEvaluator::calcDecoded( int featureIdx, int sampleIdx ) const
+{
+    Feature f = getFeature( featureIdx );
+    int p[4*CV_HAAR_FEATURE_MAX];
+    schar wt[CV_HAAR_FEATURE_MAX];
+    f.getOffsets( winSize.width + 1, p );
+    for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
+        wt[j] = (schar)f.rect[j].weight;
+    const int* img = f.tilted ? tilted.ptr<int>(sampleIdx) : sum.ptr<int>(sampleIdx);
+    return calcHaarFeature( img, p, wt );
+}
+
+void CvHaarEvaluator::calcColumn( int featureIdx, int sampleCount, float* dst ) const
+{
+    if( featureParams->lazyDecoding )
+    {
+        CvFeatureEvaluator::calcColumn( featureIdx, sampleCount, dst );
+        return;
+    }
+    int p[4*CV_HAAR_FEATURE_MAX];
+    float wt[CV_HAAR_FEATURE_MAX];
+    for( int j = 0; j < 4*CV_HAAR_FEATURE_MAX; j++ )
+        p[j] = fastRects.depth() == CV_16S ? fastRects.ptr<short>(featureIdx)[j] : fastRects.ptr<int>(featureIdx)[j];
+    for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
+        wt[j] = (float)rectWeights[featureIdx*CV_HAAR_FEATURE_MAX + j];
+    const Mat& img = tiltedFlags[featureIdx] ? tilted : sum;
+    getTrainKernels().haarColumn( img.ptr<int>(0), img.step1(), normfactor.ptr<float>(0), p, wt, sampleCount, dst );
 }
 
 void CvHaarEvaluator::writeFeatures( FileStorage &fs, const Mat& featureMap ) const
 {
-    _writeFeatures( features, fs, featureMap );
+    if( !featureParams->lazyDecoding )
+    {
+        _writeFeatures( features, fs, featureMap );
+        return;
+    }
+    // only the features used by the cascade are ever materialized
+    fs << FEATURES << "[";
+    const Mat_<int>& featureMap_ = (const Mat_<int>&)featureMap;
+    for ( int fi = 0; fi < featureMap.cols; fi++ )
+        if ( featureMap_(0, fi) >= 0 )
+        {
+            fs << "{";
+            getFeature( fi ).write( fs );
+            fs << "}";
+        }
+    fs << "]";
 }
 
 void CvHaarEvaluator::writeFeature(FileStorage &fs, int fi) const
 {
-    CV_DbgAssert( fi < (int)features.size() );
-    features[fi].write(fs);
+    CV_DbgAssert( fi < numFeatures );
+    getFeature( fi ).write(fs);
+}
+
+CvHaarEvaluator::Feature CvHaarEvaluator::getFeature( int fi ) const
+{
+    return featureParams->lazyDecoding ? makeFeature( ranges.decode( fi ) ) : features[fi];
 }
 
 void CvHaarEvaluator::generateFeatures()
 {
     int mode = ((const CvHaarFeatureParams*)((CvFeatureParams*)featureParams))->mode;
-    int offset = winSize.width + 1;
-    for( int x = 0; x < winSize.width; x++ )
+    vector<CvFeatureIndexRanges::Kind> kinds;
+    for( int k = 0; k < (int)(sizeof(haarKinds)/sizeof(haarKinds[0])); k++ )
+        if( haarKindMode[k] <= mode )
+            kinds.push_back( haarKinds[k] );
+
+    if( featureParams->lazyDecoding )
     {
-        for( int y = 0; y < winSize.height; y++ )
-        {
+        // features are numbered kind by kind and decoded by getFeature
+        ranges.create( winSize, kinds, *featureParams );
+        numFeatures = ranges.total();
+        return;
+    }
+
+    int step = featureParams->posStride;
+    int offset = winSize.width + 1;
+    set<vector<int> > signatures;
+    vector<int> signature;
+    for( int x = 0; x < winSize.width; x += step )
+        for( int y = 0; y < winSize.height; y += step )
             for( int dx = 1; dx <= winSize.width; dx++ )
-            {
                 for( int dy = 1; dy <= winSize.height; dy++ )
                 {
-                    // haar_x2
-                    if ( (x+dx*2 <= winSize.width) && (y+dy <= winSize.height) )
-                    {
-                        features.push_back( Feature( offset, false,
-                            x,    y, dx*2, dy, -1,
-                            x+dx, y, dx  , dy, +2 ) );
-                    }
-                    // haar_y2
-                    if ( (x+dx <= winSize.width) && (y+dy*2 <= winSize.height) )
-                    {
-                        features.push_back( Feature( offset, false,
-                            x,    y, dx, dy*2, -1,
-                            x, y+dy, dx, dy,   +2 ) );
-                    }
-                    // haar_x3
-                    if ( (x+dx*3 <= winSize.width) && (y+dy <= winSize.height) )
+                    if( !featureParams->isCellSizeAllowed( dx, dy ) )
+                        continue;
+                    for( size_t k = 0; k < kinds.size(); k++ )
                     {
-                        features.push_back( Feature( offset, false,
-                            x,    y, dx*3, dy, -1,
-                            x+dx, y, dx  , dy, +3 ) );
-                    }
-                    // haar_y3
-                    if ( (x+dx <= winSize.width) && (y+dy*3 <= winSize.height) )
-                    {
-                        features.push_back( Feature( offset, false,
-                            x, y,    dx, dy*3, -1,
-                            x, y+dy, dx, dy,   +3 ) );
-                    }
-                    if( mode != CvHaarFeatureParams::BASIC )
-                    {
-                        // haar_x4
-                        if ( (x+dx*4 <= winSize.width) && (y+dy <= winSize.height) )
+                        if( !CvFeatureIndexRanges::contains( kinds[k], winSize, x, y, dx, dy ) )
+                            continue;
+                        CvFeatureIndexRanges::Entry e = { kinds[k].id, x, y, dx, dy };
+                        Feature f = makeFeature( e );
+                        if( featureParams->dedupFeatures )
                         {
-                            features.push_back( Feature( offset, false,
-                                x,    y, dx*4, dy, -1,
-                                x+dx, y, dx*2, dy, +2 ) );
-                        }
-                        // haar_y4
-                        if ( (x+dx <= winSize.width ) && (y+dy*4 <= winSize.height) )
-                        {
-                            features.push_back( Feature( offset, false,
-                                x, y,    dx, dy*4, -1,
-                                x, y+dy, dx, dy*2, +2 ) );
-                        }
-                    }
-                    // x2_y2
-                    if ( (x+dx*2 <= winSize.width) && (y+dy*2 <= winSize.height) )
-                    {
-                        features.push_back( Feature( offset, false,
-                            x,    y,    dx*2, dy*2, -1,
-                            x,    y,    dx,   dy,   +2,
-                            x+dx, y+dy, dx,   dy,   +2 ) );
-                    }
-                    if (mode != CvHaarFeatureParams::BASIC)
-                    {
-                        if ( (x+dx*3 <= winSize.width) && (y+dy*3 <= winSize.height) )
-                        {
-                            features.push_back( Feature( offset, false,
-                                x   , y   , dx*3, dy*3, -1,
-                                x+dx, y+dy, dx  , dy  , +9) );
-                        }
-                    }
-                    if (mode == CvHaarFeatureParams::ALL)
-                    {
-                        // tilted haar_x2
-                        if ( (x+2*dx <= winSize.width) && (y+2*dx+dy <= winSize.height) && (x-dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x, y, dx*2, dy, -1,
-                                x, y, dx,   dy, +2 ) );
-                        }
-                        // tilted haar_y2
-                        if ( (x+dx <= winSize.width) && (y+dx+2*dy <= winSize.height) && (x-2*dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x, y, dx, 2*dy, -1,
-                                x, y, dx, dy,   +2 ) );
-                        }
-                        // tilted haar_x3
-                        if ( (x+3*dx <= winSize.width) && (y+3*dx+dy <= winSize.height) && (x-dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x,    y,    dx*3, dy, -1,
-                                x+dx, y+dx, dx,   dy, +3 ) );
-                        }
-                        // tilted haar_y3
-                        if ( (x+dx <= winSize.width) && (y+dx+3*dy <= winSize.height) && (x-3*dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x,    y,    dx, 3*dy, -1,
-                                x-dy, y+dy, dx, dy,   +3 ) );
-                        }
-                        // tilted haar_x4
-                        if ( (x+4*dx <= winSize.width) && (y+4*dx+dy <= winSize.height) && (x-dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x,    y,    dx*4, dy, -1,
-                                x+dx, y+dx, dx*2, dy, +2 ) );
-                        }
-                        // tilted haar_y4
-                        if ( (x+dx <= winSize.width) && (y+dx+4*dy <= winSize.height) && (x-4*dy>= 0) )
-                        {
-                            features.push_back( Feature( offset, true,
-                                x,    y,    dx, 4*dy, -1,
-                                x-dy, y+dy, dx, 2*dy, +2 ) );
+                            f.getSignature( offset, signature );
+                            if( !signatures.insert( signature ).second )
+                                continue;
                         }
+                        features.push_back( f );
                     }
                 }
-            }
-        }
-    }
     numFeatures = (int)features.size();
 }
 
+CvHaarEvaluator::Feature CvHaarEvaluator::makeFeature( const CvFeatureIndexRanges::Entry& e )
+{
+    int x = e.x, y = e.y, dx = e.dx, dy = e.dy;
+    switch( e.kind )
+    {
+    case 0: // haar_x2
+        return Feature( false,
+            x,    y, dx*2, dy, -1,
+            x+dx, y, dx  , dy, +2 );
+    case 1: // haar_y2
+        return Feature( false,
+            x,    y, dx, dy*2, -1,
+            x, y+dy, dx, dy,   +2 );
+    case 2: // haar_x3
+        return Feature( false,
+            x,    y, dx*3, dy, -1,
+            x+dx, y, dx  , dy, +3 );
+    case 3: // haar_y3
+        return Feature( false,
+            x, y,    dx, dy*3, -1,
+            x, y+dy, dx, dy,   +3 );
+    case 4: // haar_x4
+        return Feature( false,
+            x,    y, dx*4, dy, -1,
+            x+dx, y, dx*2, dy, +2 );
+    case 5: // haar_y4
+        return Feature( false,
+            x, y,    dx, dy*4, -1,
+            x, y+dy, dx, dy*2, +2 );
+    case 6: // x2_y2
+        return Feature( false,
+            x,    y,    dx*2, dy*2, -1,
+            x,    y,    dx,   dy,   +2,
+            x+dx, y+dy, dx,   dy,   +2 );
+    case 7: // x3_y3
+        return Feature( false,
+            x   , y   , dx*3, dy*3, -1,
+            x+dx, y+dy, dx  , dy  , +9 );
+    case 8: // tilted haar_x2
+        return Feature( true,
+            x, y, dx*2, dy, -1,
+            x, y, dx,   dy, +2 );
+    case 9: // tilted haar_y2
+        return Feature( true,
+            x, y, dx, 2*dy, -1,
+            x, y, dx, dy,   +2 );
+    case 10: // tilted haar_x3
+        return Feature( true,
+            x,    y,    dx*3, dy, -1,
+            x+dx, y+dx, dx,   dy, +3 );
+    case 11: // tilted haar_y3
+        return Feature( true,
+            x,    y,    dx, 3*dy, -1,
+            x-dy, y+dy, dx, dy,   +3 );
+    case 12: // tilted haar_x4
+        return Feature( true,
+            x,    y,    dx*4, dy, -1,
+            x+dx, y+dx, dx*2, dy, +2 );
+    case 13: // tilted haar_y4
+        return Feature( true,
+            x,    y,    dx, 4*dy, -1,
+            x-dy, y+dy, dx, 2*dy, +2 );
+    }
+    CV_Error( CV_StsBadArg, "unknown haar feature kind" );
+    return Feature();
+}
+
 CvHaarEvaluator::Feature::Feature()
 {
     tilted = false;
@@ -251,7 +370,7 @@ CvHaarEvaluator::Feature::Feature()
     rect[0].weight = rect[1].weight = rect[2].weight = 0;
 }
 
-CvHaarEvaluator::Feature::Feature( int offset, bool _tilted,
+CvHaarEvaluator::Feature::Feature( bool _tilted,
                                           int x0, int y0, int w0, int h0, float wt0,
                                           int x1, int y1, int w1, int h1, float wt1,
                                           int x2, int y2, int w2, int h2, float wt2 )
@@ -275,25 +394,69 @@ CvHaarEvaluator::Feature::Feature( int offset, bool _tilted,
     rect[2].r.width  = w2;
     rect[2].r.height = h2;
     rect[2].weight   = wt2;
+}
 
-    if( !tilted )
+void CvHaarEvaluator::Feature::getOffsets( int offset, int* p ) const
+{
+    for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++, p += 4 )
     {
-        for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
+        if( rect[j].weight == 0.0F )
+        {
+            p[0] = p[1] = p[2] = p[3] = 0;
+        }
+        else if( !tilted )
+        {
+            CV_SUM_OFFSETS( p[0], p[1], p[2], p[3], rect[j].r, offset )
+        }
+        else
         {
-            if( rect[j].weight == 0.0F )
-                break;
-            CV_SUM_OFFSETS( fastRect[j].p0, fastRect[j].p1, fastRect[j].p2, fastRect[j].p3, rect[j].r, offset )
+            CV_TILTED_OFFSETS( p[0], p[1], p[2], p[3], rect[j].r, offset )
         }
     }
-    else
+}
+
+// Canonical form of the response: the integral table coefficients of all rectangles
+// with the entries that are identically zero dropped (first row and column, and the
+// first row of the tilted table), tilted first-column entries folded onto the
+// equal T(1, y-1), and the coefficients divided by their gcd and made to start positive.
+void CvHaarEvaluator::Feature::getSignature( int offset, vector<int>& signature ) const
+{
+    int p[4*CV_HAAR_FEATURE_MAX];
+    getOffsets( offset, p );
+    map<int, int> coeffs;
+    for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
     {
-        for( int j = 0; j < CV_HAAR_FEATURE_MAX; j++ )
+        int wt = cvRound( rect[j].weight );
+        for( int c = 0; c < 4; c++ )
         {
-            if( rect[j].weight == 0.0F )
-                break;
-            CV_TILTED_OFFSETS( fastRect[j].p0, fastRect[j].p1, fastRect[j].p2, fastRect[j].p3, rect[j].r, offset )
+            int px = p[j*4 + c] % offset, py = p[j*4 + c] / offset;
+            if( tilted && px == 0 && py > 0 )
+                px = 1, py--;
+            if( py == 0 || (!tilted && px == 0) || wt == 0 )
+                continue;
+            coeffs[px + py*offset] += (c == 0 || c == 3) ? wt : -wt;
         }
     }
+    int g = 0, sign = 0;
+    for( map<int, int>::const_iterator it = coeffs.begin(); it != coeffs.end(); ++it )
+    {
+        if( it->second == 0 )
+            continue;
+        if( sign == 0 )
+            sign = it->second < 0 ? -1 : 1;
+        int a = std::abs( it->second ), b = g;
+        while( b ) { int t = a % b; a = b; b = t; }
+        g = a;
+    }
+    signature.clear();
+    signature.push_back( tilted );
+    for( map<int, int>::const_iterator it = coeffs.begin(); it != coeffs.end(); ++it )
+    {
+        if( it->second == 0 )
+            continue;
+        signature.push_back( it->first );
+        signature.push_back( it->second / g * sign );
+    }
 }
 
 void CvHaarEvaluator::Feature::write( FileStorage &fs ) const
@@ -35,20 +35,23 @@ public:
         int _maxSampleCount, cv::Size _winSize );
     virtual void setImage(const cv::Mat& img, uchar clsLabel, int idx);
     virtual float operator()(int featureIdx, int sampleIdx) const;
+    virtual void calcColumn( int featureIdx, int sampleCount, float* dst ) const;
     virtual void writeFeatures( cv::FileStorage &fs, const cv::Mat& featureMap ) const;
     void writeFeature( cv::FileStorage &fs, int fi ) const; // for old file fornat
 protected:
     virtual void generateFeatures();
+    void packFeatures();
 
     class Feature
     {
     public:
         Feature();
-        Feature( int offset, bool _tilted,
+        Feature( bool _tilted,
             int x0, int y0, int w0, int h0, float wt0,
             int x1, int y1, int w1, int h1, float wt1,
             int x2 = 0, int y2 = 0, int w2 = 0, int h2 = 0, float wt2 = 0.0F );
-        float calc( const cv::Mat &sum, const cv::Mat &tilted, size_t y) const;
+        void getOffsets( int offset, int* p ) const;
+        void getSignature( int offset, std::vector<int>& signature ) const;
         void write( cv::FileStorage &fs ) const;
 
         bool  tilted;
@@ -57,33 +60,45 @@ protected:
             cv::Rect r;
             float weight;
         } rect[CV_HAAR_FEATURE_MAX];
-
-        struct
-        {
-            int p0, p1, p2, p3;
-        } fastRect[CV_HAAR_FEATURE_MAX];
     };
 
-    std::vector<Feature> features;
+    Feature getFeature( int fi ) const;
+    static Feature makeFeature( const CvFeatureIndexRanges::Entry& e );
+    float calcDecoded( int featureIdx, int sampleIdx ) const;
+
+    std::vector<Feature> features; /* rectangles as written to the cascade, not used by operator() */
+    CvFeatureIndexRanges ranges;   /* feature numbering in lazy decoding mode, features is empty then */
+    cv::Mat  fastRects;   /* 4 offsets per rectangle (each row represents feature), CV_16S if the integral fits */
+    std::vector<schar> rectWeights; /* CV_HAAR_FEATURE_MAX weights per feature, 0 for unused rectangles */
+    std::vector<uchar> tiltedFlags;
     cv::Mat  sum;         /* sum images (each row represents image) */
-    cv::Mat  tilted;      /* tilted sum images (each row represents image) */
+    cv::Mat  tilted;      /* tilted sum images, empty if no feature is tilted */
     cv::Mat  normfactor;  /* normalization factor */
 };
 
-inline float CvHaarEvaluator::operator()(int featureIdx, int sampleIdx) const
+template<typename _Tp>
+inline float calcHaarFeature( const int* img, const _Tp* p, const schar* wt )
 {
-    float nf = normfactor.at<float>(0, sampleIdx);
-    return !nf ? 0.0f : (features[featureIdx].calc( sum, tilted, sampleIdx)/nf);
+    // unused rectangles have zero offsets and weight, so they add nothing
+    float ret = (float)wt[0] * (img[p[0]] - img[p[1]] - img[p[2]] + img[p[3]]) +
+        (float)wt[1] * (img[p[4]] - img[p[5]] - img[p[6]] + img[p[7]]);
+    ret += (float)wt[2] * (img[p[8]] - img[p[9]] - img[p[10]] + img[p[11]]);
+    return ret;
 }
 
-inline float CvHaarEvaluator::Feature::calc( const cv::Mat &_sum, const cv::Mat &_tilted, size_t y) const
+inline float CvHaarEvaluator::operator()(int featureIdx, int sampleIdx) const
 {
-    const int* img = tilted ? _tilted.ptr<int>((int)y) : _sum.ptr<int>((int)y);
-    float ret = rect[0].weight * (img[fastRect[0].p0] - img[fastRect[0].p1] - img[fastRect[0].p2] + img[fastRect[0].p3] ) +
-        rect[1].weight * (img[fastRect[1].p0] - img[fastRect[1].p1] - img[fastRect[1].p2] + img[fastRect[1].p3] );
-    if( rect[2].weight != 0.0f )
-        ret += rect[2].weight * (img[fastRect[2].p0] - img[fastRect[2].p1] - img[fastRect[2].p2] + img[fastRect[2].p3] );
-    return ret;
+    float nf = normfactor.at<float>(0, sampleIdx);
+    if( !nf )
+        return 0.0f;
+    if( featureParams->lazyDecoding )
+        return calcDecoded( featureIdx, sampleIdx )/nf;
+    const int* img = tiltedFlags[featureIdx] ? tilted.ptr<int>(sampleIdx) : sum.ptr<int>(sampleIdx);
+    const schar* wt = &rectWeights[featureIdx * CV_HAAR_FEATURE_MAX];
+    float ret = fastRects.depth() == CV_16S ?
+        calcHaarFeature( img, fastRects.ptr<short>(featureIdx), wt ) :
+        calcHaarFeature( img, fastRects.ptr<int>(featureIdx), wt );
+    return ret/nf;
 }
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "lbpfeatures.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 
 using namespace cv;
 
@@ -17,6 +18,32 @@ void CvLBPEvaluator::init(const CvFeatureParams *_featureParams, int _maxSampleC
     CV_Assert( _maxSampleCount > 0);
     sum.create((int)_maxSampleCount, (_winSize.width + 1) * (_winSize.height + 1), CV_32SC1);
     CvFeatureEvaluator::init( _featureParams, _maxSampleCount, _winSize );
+    packFeatures();
+}
+
+void CvLBPEvaluator::packFeatures()
+{
+    if( featureParams->lazyDecoding )
+    {
+        // nothing is stored per feature, operator() decodes the index
+        fastRects.release();
+        return;
+    }
+    int offset = winSize.width + 1;
+    int depth = (winSize.height + 1) * offset <= SHRT_MAX ? CV_16S : CV_32S;
+    fastRects.create( numFeatures, 16, depth );
+    for( int fi = 0; fi < numFeatures; fi++ )
+    {
+        int p[16];
+        features[fi].getOffsets( offset, p );
+        for( int j = 0; j < 16; j++ )
+        {
+            if( depth == CV_16S )
+                fastRects.ptr<short>(fi)[j] = (short)p[j];
+            else
+                fastRects.ptr<int>(fi)[j] = p[j];
+        }
+    }
 }
 
 void CvLBPEvaluator::setImage(const Mat &img, uchar clsLabel, int idx)
@@ -24,23 +51,76 @@ void CvLBPEvaluator::setImage(const Mat &img, uchar clsLabel, int idx)
     CV_DbgAssert( !sum.empty() );
     CvFeatureEvaluator::setImage( img, clsLabel, idx );
     Mat innSum(winSize.height + 1, winSize.width + 1, sum.type(), sum.ptr<int>((int)idx));
-    integral( img, innSum );
+    Mat noTilted;
+    calcWindowIntegrals( img, innSum, noTilted );
+}
+
+float CvLBPEvaluator::calcDecoded( int featureIdx, int sampleIdx ) const
+{
+    int p[16];
+    getFeature( featureIdx ).getOffsets( winSize.width + 1, p );
+    return (float)calcLBPCode( sum.ptr<int>(sampleIdx), p );
+}
+
+void CvLBPEvaluator::calcColumn( int featureIdx, int sampleCount, float* dst ) const
+{
+    if( featureParams->lazyDecoding )
+    {
+        CvFeatureEvaluator::calcColumn( featureIdx, sampleCount, dst );
+        return;
+    }
+    int p[16];
+    for( int j = 0; j < 16; j++ )
+        p[j] = fastRects.depth() == CV_16S ? fastRects.ptr<short>(featureIdx)[j] : fastRects.ptr<int>(featureIdx)[j];
+    getTrainKernels().lbpColumn( sum.ptr<int>(0), sum.step1(), p, sampleCount, dst );
 }
 
 void CvLBPEvaluator::writeFeatures( FileStorage &fs, const Mat& featureMap ) const
 {
-    _writeFeatures( features, fs, featureMap );
+    if( !featureParams->lazyDecoding )
+    {
+        _writeFeatures( features, fs, featureMap );
+        return;
+    }
+    // only the features used by the cascade are ever materialized
+    fs << FEATURES << "[";
+    const Mat_<int>& featureMap_ = (const Mat_<int>&)featureMap;
+    for ( int fi = 0; fi < featureMap.cols; fi++ )
+        if ( featureMap_(0, fi) >= 0 )
+        {
+            fs << "{";
+            getFeature( fi ).write( fs );
+            fs << "}";
+        }
+    fs << "]";
+}
+
+CvLBPEvaluator::Feature CvLBPEvaluator::getFeature( int fi ) const
+{
+    if( !featureParams->lazyDecoding )
+        return features[fi];
+    CvFeatureIndexRanges::Entry e = ranges.decode( fi );
+    return Feature( e.x, e.y, e.dx, e.dy );
 }
 
 void CvLBPEvaluator::generateFeatures()
 {
-    int offset = winSize.width + 1;
-    for( int x = 0; x < winSize.width; x++ )
-        for( int y = 0; y < winSize.height; y++ )
+    if( featureParams->lazyDecoding )
+    {
+        // a block of 3x3 cells of size (w, h) at every x + 3*w <= W, y + 3*h <= H
+        CvFeatureIndexRanges::Kind block = { 0, 0, 3, 0, 3 };
+        ranges.create( winSize, std::vector<CvFeatureIndexRanges::Kind>( 1, block ), *featureParams );
+        numFeatures = ranges.total();
+        return;
+    }
+    int step = featureParams->posStride;
+    for( int x = 0; x < winSize.width; x += step )
+        for( int y = 0; y < winSize.height; y += step )
             for( int w = 1; w <= winSize.width / 3; w++ )
                 for( int h = 1; h <= winSize.height / 3; h++ )
-                    if ( (x+3*w <= winSize.width) && (y+3*h <= winSize.height) )
-                        features.push_back( Feature(offset, x, y, w, h ) );
+                    if ( (x+3*w <= winSize.width) && (y+3*h <= winSize.height) &&
+                         featureParams->isCellSizeAllowed( w, h ) )
+                        features.push_back( Feature( x, y, w, h ) );
     numFeatures = (int)features.size();
 }
 
@@ -49,9 +129,14 @@ CvLBPEvaluator::Feature::Feature()
     rect = cvRect(0, 0, 0, 0);
 }
 
-CvLBPEvaluator::Feature::Feature( int offset, int x, int y, int _blockWidth, int _blockHeight )
+CvLBPEvaluator::Feature::Feature( int x, int y, int _blockWidth, int _blockHeight )
+{
+    rect = cvRect(x, y, _blockWidth, _blockHeight);
+}
+
+void CvLBPEvaluator::Feature::getOffsets( int offset, int* p ) const
 {
-    Rect tr = rect = cvRect(x, y, _blockWidth, _blockHeight);
+    Rect tr = rect;
     CV_SUM_OFFSETS( p[0], p[1], p[4], p[5], tr, offset )
     tr.x += 2*rect.width;
     CV_SUM_OFFSETS( p[2], p[3], p[6], p[7], tr, offset )
@@ -17,31 +17,36 @@ public:
     virtual void init(const CvFeatureParams *_featureParams,
         int _maxSampleCount, cv::Size _winSize );
     virtual void setImage(const cv::Mat& img, uchar clsLabel, int idx);
-    virtual float operator()(int featureIdx, int sampleIdx) const
-    { return (float)features[featureIdx].calc( sum, sampleIdx); }
+    virtual float operator()(int featureIdx, int sampleIdx) const;
+    virtual void calcColumn( int featureIdx, int sampleCount, float* dst ) const;
     virtual void writeFeatures( cv::FileStorage &fs, const cv::Mat& featureMap ) const;
 protected:
     virtual void generateFeatures();
+    void packFeatures();
 
     class Feature
     {
     public:
         Feature();
-        Feature( int offset, int x, int y, int _block_w, int _block_h  );
-        uchar calc( const cv::Mat& _sum, size_t y ) const;
+        Feature( int x, int y, int _block_w, int _block_h  );
+        void getOffsets( int offset, int* p ) const;
         void write( cv::FileStorage &fs ) const;
 
         cv::Rect rect;
-        int p[16];
     };
-    std::vector<Feature> features;
+    Feature getFeature( int fi ) const;
+    float calcDecoded( int featureIdx, int sampleIdx ) const;
+
+    std::vector<Feature> features; // blocks as written to the cascade, not used by operator()
+    CvFeatureIndexRanges ranges; // feature numbering in lazy decoding mode, features is empty then
+    cv::Mat fastRects; // 16 sum offsets per feature (each row represents feature), CV_16S if the integral fits
 
     cv::Mat sum;
 };
 
-inline uchar CvLBPEvaluator::Feature::calc(const cv::Mat &_sum, size_t y) const
+template<typename _Tp>
+inline uchar calcLBPCode( const int* psum, const _Tp* p )
 {
-    const int* psum = _sum.ptr<int>((int)y);
     int cval = psum[p[5]] - psum[p[6]] - psum[p[9]] + psum[p[10]];
 
     return (uchar)((psum[p[0]] - psum[p[1]] - psum[p[4]] + psum[p[5]] >= cval ? 128 : 0) |   // 0
@@ -54,4 +59,14 @@ inline uchar CvLBPEvaluator::Feature::calc(const cv::Mat &_sum, size_t y) const
         (psum[p[4]] - psum[p[5]] - psum[p[8]] + psum[p[9]] >= cval ? 1 : 0));     // 3
 }
 
+inline float CvLBPEvaluator::operator()(int featureIdx, int sampleIdx) const
+{
+    if( featureParams->lazyDecoding )
+        return calcDecoded( featureIdx, sampleIdx );
+    const int* psum = sum.ptr<int>(sampleIdx);
+    return (float)(fastRects.depth() == CV_16S ?
+        calcLBPCode( psum, fastRects.ptr<short>(featureIdx) ) :
+        calcLBPCode( psum, fastRects.ptr<int>(featureIdx) ));
+}
+
 #endif
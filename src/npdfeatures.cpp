@@ -0,0 +1,82 @@
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/internal.hpp"
+
+#include "npdfeatures.h"
+#include "cascadeclassifier.h"
+
+using namespace cv;
+
+CvNPDFeatureParams::CvNPDFeatureParams()
+{
+    maxCatCount = 0;
+    name = NPDF_NAME;
+}
+
+void CvNPDEvaluator::init(const CvFeatureParams *_featureParams, int _maxSampleCount, Size _winSize)
+{
+    CV_Assert( _maxSampleCount > 0);
+    CV_Assert( _winSize.area() <= USHRT_MAX + 1 );
+    pixels.create((int)_maxSampleCount, _winSize.area(), CV_8UC1);
+    CvFeatureEvaluator::init( _featureParams, _maxSampleCount, _winSize );
+
+    fastPixels.create( numFeatures, 2, CV_16UC1 );
+    for( int fi = 0; fi < numFeatures; fi++ )
+    {
+        fastPixels.ptr<ushort>(fi)[0] = (ushort)(features[fi].p1.y * winSize.width + features[fi].p1.x);
+        fastPixels.ptr<ushort>(fi)[1] = (ushort)(features[fi].p2.y * winSize.width + features[fi].p2.x);
+    }
+
+    npdTable.create( 256, 256, CV_32FC1 );
+    for( int a = 0; a < 256; a++ )
+    {
+        float* row = npdTable.ptr<float>(a);
+        for( int b = 0; b < 256; b++ )
+            row[b] = a + b == 0 ? 0.f : (float)(a - b) / (float)(a + b);
+    }
+}
+
+void CvNPDEvaluator::setImage(const Mat &img, uchar clsLabel, int idx)
+{
+    CV_DbgAssert( !pixels.empty() );
+    CvFeatureEvaluator::setImage( img, clsLabel, idx );
+    Mat innPixels(winSize.height, winSize.width, pixels.type(), pixels.ptr<uchar>((int)idx));
+    img.copyTo( innPixels );
+}
+
+void CvNPDEvaluator::writeFeatures( FileStorage &fs, const Mat& featureMap ) const
+{
+    _writeFeatures( features, fs, featureMap );
+}
+
+void CvNPDEvaluator::generateFeatures()
+{
+    // every unordered pair of distinct pixels on the posStride grid, in raster order
+    int step = featureParams->posStride;
+    for( int y1 = 0; y1 < winSize.height; y1 += step )
+        for( int x1 = 0; x1 < winSize.width; x1 += step )
+        {
+            int x2 = x1 + step, y2 = y1;
+            if( x2 >= winSize.width )
+                x2 = 0, y2 += step;
+            for( ; y2 < winSize.height; y2 += step, x2 = 0 )
+                for( ; x2 < winSize.width; x2 += step )
+                    features.push_back( Feature( x1, y1, x2, y2 ) );
+        }
+    numFeatures = (int)features.size();
+}
+
+CvNPDEvaluator::Feature::Feature()
+{
+    p1 = p2 = Point(0, 0);
+}
+
+CvNPDEvaluator::Feature::Feature( int x1, int y1, int x2, int y2 )
+{
+    p1 = Point(x1, y1);
+    p2 = Point(x2, y2);
+}
+
+void CvNPDEvaluator::Feature::write(FileStorage &fs) const
+{
+    fs << CC_NPD_POINTS << "[:" << p1.x << p1.y << p2.x << p2.y << "]";
+}
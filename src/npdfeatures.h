@@ -0,0 +1,51 @@
+#ifndef _OPENCV_NPDFEATURES_H_
+#define _OPENCV_NPDFEATURES_H_
+
+#include "traincascade_features.h"
+
+#define NPDF_NAME "npdFeatureParams"
+struct CvNPDFeatureParams : CvFeatureParams
+{
+    CvNPDFeatureParams();
+
+};
+
+// Normalized pixel difference features: f(a, b) = (a - b)/(a + b) of two pixel
+// intensities of the window, f(0, 0) = 0. The response is a single table lookup
+// on two bytes, no integral image is involved.
+class CvNPDEvaluator : public CvFeatureEvaluator
+{
+public:
+    virtual ~CvNPDEvaluator() {}
+    virtual void init(const CvFeatureParams *_featureParams,
+        int _maxSampleCount, cv::Size _winSize );
+    virtual void setImage(const cv::Mat& img, uchar clsLabel, int idx);
+    virtual float operator()(int featureIdx, int sampleIdx) const;
+    virtual void writeFeatures( cv::FileStorage &fs, const cv::Mat& featureMap ) const;
+protected:
+    virtual void generateFeatures();
+
+    class Feature
+    {
+    public:
+        Feature();
+        Feature( int x1, int y1, int x2, int y2 );
+        void write( cv::FileStorage &fs ) const;
+
+        cv::Point p1, p2;
+    };
+    std::vector<Feature> features; // pixel pairs as written to the cascade, not used by operator()
+    cv::Mat fastPixels; // CV_16U indices of both pixels in the window (each row represents feature)
+
+    cv::Mat pixels; // window pixels (each row represents image)
+    cv::Mat npdTable; // 256x256 table of f(a, b)
+};
+
+inline float CvNPDEvaluator::operator()(int featureIdx, int sampleIdx) const
+{
+    const uchar* px = pixels.ptr<uchar>(sampleIdx);
+    const ushort* p = fastPixels.ptr<ushort>(featureIdx);
+    return npdTable.ptr<float>(px[p[0]])[px[p[1]]];
+}
+
+#endif
@@ -0,0 +1,104 @@
+#include "scratchfile.h"
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/types.h>
+#  include <fcntl.h>
+#  include <errno.h>
+#  include <unistd.h>
+#  include <stdlib.h>
+#  include <vector>
+#endif
+
+using namespace std;
+
+#ifndef _WIN32
+// reserves the blocks of the file, writing to a sparse file the disk cannot hold
+// would kill the process with SIGBUS instead of failing here
+static bool reserveFile( int fd, size_t size )
+{
+#ifndef __APPLE__
+    int err = posix_fallocate( fd, 0, (off_t)size );
+    if( err == 0 )
+        return true;
+    if( err != EINVAL && err != EOPNOTSUPP )
+        return false;
+#endif
+    // the file system cannot reserve the space, the file stays sparse
+    return ftruncate( fd, (off_t)size ) == 0;
+}
+#endif
+
+CvScratchFile::CvScratchFile() : ptr( 0 ), length( 0 ), file( 0 ), mapping( 0 ) {}
+
+CvScratchFile::~CvScratchFile()
+{
+    release();
+}
+
+void* CvScratchFile::create( const string& dir, size_t size )
+{
+    release();
+    if( size == 0 )
+        return 0;
+#ifdef _WIN32
+    char name[MAX_PATH];
+    if( !GetTempFileNameA( dir.empty() ? "." : dir.c_str(), "tcs", 0, name ) )
+        return 0;
+    HANDLE hfile = CreateFileA( name, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0 );
+    if( hfile == INVALID_HANDLE_VALUE )
+        return 0;
+    unsigned long long sz = size;
+    HANDLE hmap = CreateFileMappingA( hfile, 0, PAGE_READWRITE, (DWORD)(sz >> 32), (DWORD)sz, 0 );
+    void* p = hmap ? MapViewOfFile( hmap, FILE_MAP_ALL_ACCESS, 0, 0, size ) : 0;
+    if( !p )
+    {
+        if( hmap )
+            CloseHandle( hmap );
+        CloseHandle( hfile );
+        return 0;
+    }
+    file = hfile;
+    mapping = hmap;
+#else
+    string templ = (dir.empty() ? string( "." ) : dir) + "/traincascade_XXXXXX";
+    vector<char> name( templ.begin(), templ.end() );
+    name.push_back( '\0' );
+    int fd = mkstemp( &name[0] );
+    if( fd < 0 )
+        return 0;
+    unlink( &name[0] );
+    void* p = MAP_FAILED;
+    if( reserveFile( fd, size ) )
+        p = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    // the mapping keeps the file alive
+    close( fd );
+    if( p == MAP_FAILED )
+        return 0;
+#endif
+    ptr = p;
+    length = size;
+    return ptr;
+}
+
+void CvScratchFile::release()
+{
+    if( !ptr )
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile( ptr );
+    CloseHandle( (HANDLE)mapping );
+    CloseHandle( (HANDLE)file );
+    file = mapping = 0;
+#else
+    munmap( ptr, length );
+#endif
+    ptr = 0;
+    length = 0;
+}
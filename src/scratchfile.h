@@ -0,0 +1,30 @@
+#ifndef _OPENCV_SCRATCHFILE_H_
+#define _OPENCV_SCRATCHFILE_H_
+
+#include <string>
+#include <cstddef>
+
+// Anonymous file in a scratch directory mapped into memory. The file is removed
+// from the directory right away, so nothing is left behind if training stops.
+class CvScratchFile
+{
+public:
+    CvScratchFile();
+    ~CvScratchFile();
+    // returns 0 if the file cannot be created or mapped
+    void* create( const std::string& dir, size_t size );
+    void release();
+    void* data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    CvScratchFile( const CvScratchFile& );
+    CvScratchFile& operator=( const CvScratchFile& );
+
+    void*  ptr;
+    size_t length;
+    void*  file;    /* file handle (Windows) */
+    void*  mapping; /* file mapping handle (Windows) */
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "cv.h"
 #include "cascadeclassifier.h"
+#include "traincascade_kernels.h"
 
 using namespace std;
 using namespace cv;
@@ -16,13 +17,15 @@ int main( int argc, char* argv[] )
     int numStages = 20;
     int precalcValBufSize = 256,
         precalcIdxBufSize = 256;
+    string kernelsName = "auto";
     bool baseFormatSave = false;	//ĬϲԾɸʽ漶ļҸòhaarЧ
 
     CvCascadeParams cascadeParams;
     CvCascadeBoostParams stageParams;
     Ptr<CvFeatureParams> featureParams[] = { Ptr<CvFeatureParams>(new CvHaarFeatureParams),
                                              Ptr<CvFeatureParams>(new CvLBPFeatureParams),
-                                             Ptr<CvFeatureParams>(new CvHOGFeatureParams)
+                                             Ptr<CvFeatureParams>(new CvHOGFeatureParams),
+                                             Ptr<CvFeatureParams>(new CvNPDFeatureParams)
                                            };
     int fc = sizeof(featureParams)/sizeof(featureParams[0]);	//ָ麬жٸָ
     if( argc == 1 )
@@ -37,6 +40,7 @@ int main( int argc, char* argv[] )
         cout << "  [-precalcValBufSize <precalculated_vals_buffer_size_in_Mb = " << precalcValBufSize << ">]" << endl;
         cout << "  [-precalcIdxBufSize <precalculated_idxs_buffer_size_in_Mb = " << precalcIdxBufSize << ">]" << endl;
         cout << "  [-baseFormatSave]" << endl;
+        cout << "  [-kernels <auto|SSE2|AVX2|AVX512 = " << kernelsName << ">]" << endl;
         cascadeParams.printDefaults();
         stageParams.printDefaults();
         for( int fi = 0; fi < fc; fi++ )
@@ -83,22 +87,39 @@ int main( int argc, char* argv[] )
         {
             baseFormatSave = true;
         }
+        else if( !strcmp( argv[i], "-kernels" ) )
+        {
+            kernelsName = argv[++i];
+        }
         else if ( cascadeParams.scanAttr( argv[i], argv[i+1] ) ) { i++; }	//ѡstageType, featureType, w, h,˺˵
         else if ( stageParams.scanAttr( argv[i], argv[i+1] ) ) { i++; }		//ѡbt, minHitRate, maxFalseAlarmRate, weightTrimRate, maxDepth, maxWeakCount, ˺һǿ˵
         else if ( !set )	//ֻHaarãѡmode
         {
+            // every feature type gets the chance to pick up its own attributes
             for( int fi = 0; fi < fc; fi++ )
-            {
-                set = featureParams[fi]->scanAttr(argv[i], argv[i+1]);	//LBP&HOGʹCvParamsеĬ麯HaarԼ
-                if ( !set )												//ض麯ѡHarmodeBASICCOREALLѡ
-                {
-                    i++;
-                    break;
-                }
-            }
+                set = featureParams[fi]->scanAttr(argv[i], argv[i+1]) || set;
+            i++;
         }
     }
 
+    // the pool options are shared by the feature types, a bad value is only caught here
+    if( !featureParams[cascadeParams.featureType]->checkPoolParams() )
+    {
+        cout << "Invalid feature pool parameters:" << endl;
+        featureParams[cascadeParams.featureType]->printAttrs();
+        cout << "Usage:" << endl;
+        featureParams[cascadeParams.featureType]->printDefaults();
+        return -1;
+    }
+
+    if( !setTrainKernels( kernelsName ) )
+    {
+        cout << "Kernels " << kernelsName << " are not supported by this build or CPU" << endl;
+        printTrainKernels();
+        return -1;
+    }
+    printTrainKernels();
+
     classifier.train( cascadeDirName,
                       vecName,
                       bgName,
@@ -31,9 +31,12 @@
            + (step) * ((rect).y + (rect).width + (rect).height);
 
 float calcNormFactor( const cv::Mat& sum, const cv::Mat& sqSum );
+// fills the sum (and, if not empty, the tilted) integral of a CV_8U window and
+// returns its normalization factor, equal to calcNormFactor( sum, sqSum )
+float calcWindowIntegrals( const cv::Mat& img, cv::Mat& sum, cv::Mat& tilted );
 
 template<class Feature>
-void _writeFeatures( const std::vector<Feature> features, cv::FileStorage &fs, const cv::Mat& featureMap )
+void _writeFeatures( const std::vector<Feature>& features, cv::FileStorage &fs, const cv::Mat& featureMap )
 {
     fs << FEATURES << "[";
     const cv::Mat_<int>& featureMap_ = (const cv::Mat_<int>&)featureMap;
@@ -65,14 +68,49 @@ public:
 class CvFeatureParams : public CvParams
 {
 public:
-    enum { HAAR = 0, LBP = 1, HOG = 2 };
+    enum { HAAR = 0, LBP = 1, HOG = 2, NPD = 3 };
     CvFeatureParams();
     virtual void init( const CvFeatureParams& fp );
     virtual void write( cv::FileStorage &fs ) const;
     virtual bool read( const cv::FileNode &node );
+    virtual void printDefaults() const;
+    virtual void printAttrs() const;
+    virtual bool scanAttr( const std::string prm, const std::string val );
     static cv::Ptr<CvFeatureParams> create( int featureType );
+    bool checkPoolParams() const;
+    bool isCellSizeAllowed( int width, int height ) const;
     int maxCatCount; // 0 in case of numerical features
     int featSize; // 1 in case of simple features (HAAR, LBP) and N_BINS(9)*N_CELLS(4) in case of Dalal's HOG features
+    int lazyDecoding; // HAAR, LBP: decode features from their index on demand instead of storing the whole pool
+    // feature pool grid, applied to the elementary cell of every feature kind
+    int posStride; // positions are multiples of posStride (of 4*posStride for HOG blocks)
+    int sizeStride; // cell sides are multiples of sizeStride (of 8*sizeStride for HOG cells)
+    int minRectSize, maxRectSize; // cell side limits in pixels, 0 maxRectSize means no limit
+    float maxAspectRatio; // longer to shorter cell side, 0 means no limit
+    int dedupFeatures; // HAAR: drop features whose response equals (up to scale) an earlier one
+};
+
+// Closed-form numbering of rectangle features for lazy decoding. A kind places
+// every allowed cell size (dx, dy) at the positions x in [xlo*dy, W - xw*dx],
+// y in [0, H - yhx*dx - yhy*dy] that lie on the posStride grid; features are
+// numbered kind by kind, then by size, then by position, so an index is decoded
+// by a search over per-size prefix counts.
+class CvFeatureIndexRanges
+{
+public:
+    struct Kind { int id, xlo, xw, yhx, yhy; };
+    struct Entry { int kind, x, y, dx, dy; };
+
+    void create( cv::Size winSize, const std::vector<Kind>& kinds, const CvFeatureParams& params );
+    int total() const { return start.empty() ? 0 : start.back(); }
+    int kindCount( int kind ) const;
+    Entry decode( int idx ) const;
+    static bool contains( const Kind& k, cv::Size winSize, int x, int y, int dx, int dy );
+protected:
+    cv::Size winSize;
+    int posStride;
+    std::vector<Kind> kinds;
+    std::vector<int> start; // first index of every (kind, dx, dy), followed by the total
 };
 
 class CvFeatureEvaluator
@@ -84,6 +122,8 @@ public:
     virtual void setImage(const cv::Mat& img, uchar clsLabel, int idx);
     virtual void writeFeatures( cv::FileStorage &fs, const cv::Mat& featureMap ) const = 0;
     virtual float operator()(int featureIdx, int sampleIdx) const = 0;
+    // values of one feature for samples [0, sampleCount), the precalculation hot loop
+    virtual void calcColumn( int featureIdx, int sampleCount, float* dst ) const;
     static cv::Ptr<CvFeatureEvaluator> create(int type);
 
     int getNumFeatures() const { return numFeatures; }
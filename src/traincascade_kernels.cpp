@@ -0,0 +1,118 @@
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/internal.hpp"
+
+#include <iostream>
+
+#define CV_KERNELS_NS cv_kernels_baseline
+#if CV_SSE2
+#  define CV_KERNELS_NAME "SSE2"
+#else
+#  define CV_KERNELS_NAME "C"
+#endif
+#include "traincascade_kernels_impl.h"
+
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64)
+#  include <intrin.h>
+#  define CV_KERNELS_X86 1
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+#  include <cpuid.h>
+#  define CV_KERNELS_X86 1
+#endif
+
+using namespace std;
+
+// defined in traincascade_kernels_avx2.cpp and traincascade_kernels_avx512.cpp,
+// they return 0 if the compiler could not build the variant
+const CvTrainKernels* getTrainKernelsAVX2();
+const CvTrainKernels* getTrainKernelsAVX512();
+
+#ifdef CV_KERNELS_X86
+static void cpuid( int leaf, int subleaf, unsigned regs[4] )
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex( r, leaf, subleaf );
+    for( int i = 0; i < 4; i++ )
+        regs[i] = (unsigned)r[i];
+#else
+    __cpuid_count( leaf, subleaf, regs[0], regs[1], regs[2], regs[3] );
+#endif
+}
+
+static unsigned long long xgetbv0()
+{
+#ifdef _MSC_VER
+    return _xgetbv( 0 );
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__( "xgetbv" : "=a"(lo), "=d"(hi) : "c"(0) );
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+// AVX2 and AVX-512 need both the instructions and the OS saving the wide registers
+static void detectCpu( bool& avx2, bool& avx512 )
+{
+    avx2 = avx512 = false;
+#ifdef CV_KERNELS_X86
+    unsigned r[4];
+    cpuid( 0, 0, r );
+    if( r[0] < 7 )
+        return;
+    cpuid( 1, 0, r );
+    bool osxsave = (r[2] & (1u << 27)) != 0;
+    if( !osxsave )
+        return;
+    unsigned long long xcr0 = xgetbv0();
+    cpuid( 7, 0, r );
+    avx2 = (r[1] & (1u << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+    avx512 = (r[1] & (1u << 16)) != 0 && (xcr0 & 0xE6) == 0xE6;
+#endif
+}
+
+static const CvTrainKernels* availableKernels( const string& name )
+{
+    bool avx2, avx512;
+    detectCpu( avx2, avx512 );
+    const CvTrainKernels* k512 = avx512 ? getTrainKernelsAVX512() : 0;
+    const CvTrainKernels* k2 = avx2 ? getTrainKernelsAVX2() : 0;
+    if( name == "auto" )
+        return k512 ? k512 : k2 ? k2 : &cv_kernels_baseline::table;
+    if( k512 && name == k512->name )
+        return k512;
+    if( k2 && name == k2->name )
+        return k2;
+    if( name == cv_kernels_baseline::table.name )
+        return &cv_kernels_baseline::table;
+    return 0;
+}
+
+static const CvTrainKernels* currentKernels = 0;
+
+const CvTrainKernels& getTrainKernels()
+{
+    if( !currentKernels )
+        currentKernels = availableKernels( "auto" );
+    return *currentKernels;
+}
+
+bool setTrainKernels( const string& name )
+{
+    const CvTrainKernels* k = availableKernels( name );
+    if( k )
+        currentKernels = k;
+    return k != 0;
+}
+
+void printTrainKernels()
+{
+    bool avx2, avx512;
+    detectCpu( avx2, avx512 );
+    cout << "Training kernels: " << getTrainKernels().name << " (available: " << cv_kernels_baseline::table.name;
+    if( avx2 && getTrainKernelsAVX2() )
+        cout << " " << getTrainKernelsAVX2()->name;
+    if( avx512 && getTrainKernelsAVX512() )
+        cout << " " << getTrainKernelsAVX512()->name;
+    cout << ")" << endl;
+}
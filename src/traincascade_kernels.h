@@ -0,0 +1,54 @@
+#ifndef _OPENCV_TRAINCASCADE_KERNELS_H_
+#define _OPENCV_TRAINCASCADE_KERNELS_H_
+
+#include "opencv2/core/core.hpp"
+#include <string>
+
+// Hot loops of the trainer. traincascade_kernels_impl.h is compiled once per
+// instruction set and the best table the CPU supports is picked at startup.
+struct CvTrainKernels
+{
+    const char* name;
+
+    // integral sum, optional tilted sum and normalization factor of a CV_8U window,
+    // see calcWindowIntegrals; adiag is scratch of 2*(width + 1) ints
+    float (*windowIntegrals)( const uchar* src, size_t srcstep, int width, int height,
+                              int* sum, int* tilted, size_t step, int* adiag );
+
+    // one row of the HOG integral histogram: the orientation bins of the row are
+    // accumulated into rowSum and added in place to the integral row accHist
+    // (nbins values per point, starting at point 1) and to accNorm
+    void (*hogAccumulateRow)( const float* mag, const float* angle, float angleScale,
+                              int width, int nbins, float* rowSum, float* accHist, float* accNorm );
+
+    // responses of one Haar feature (12 offsets, 3 weights) for samples [0, n);
+    // rows of img are step ints apart, dst[i] = 0 where normfactor[i] == 0
+    void (*haarColumn)( const int* img, size_t step, const float* normfactor,
+                        const int* offsets, const float* weights, int n, float* dst );
+
+    // LBP codes of one feature (16 offsets of its 4x4 point grid) for samples [0, n);
+    // rows of img are step ints apart
+    void (*lbpColumn)( const int* img, size_t step, const int* offsets, int n, float* dst );
+
+    // one HOG component (4 offsets of a cell bin) for samples [0, n), divided by the block
+    // norms as in calcHOGComponent; rows of hist and norm are histStep and normStep floats apart
+    void (*hogColumn)( const float* hist, size_t histStep, const float* norm, size_t normStep,
+                       const int* offsets, int n, float* dst );
+
+    // stable partition of the indices src[0, n): table[src[i]] holds the new index
+    // in its low 31 bits and the direction (1 = right) in its sign bit
+    void (*partitionSorted32s)( const int* src, const int* table, int n, int* ldst, int* rdst );
+    void (*partitionSorted16u)( const int* src, const int* table, int n, ushort* ldst, ushort* rdst );
+
+    // stable partition of src[0, n) by dir[i] (1 = right)
+    void (*partition32s)( const int* src, const char* dir, int n, int* ldst, int* rdst );
+    void (*partition16u)( const int* src, const char* dir, int n, ushort* ldst, ushort* rdst );
+};
+
+const CvTrainKernels& getTrainKernels();
+// "auto" picks the widest set the CPU supports; otherwise one of the names
+// printed by printTrainKernels. Returns false if the set is unavailable.
+bool setTrainKernels( const std::string& name );
+void printTrainKernels();
+
+#endif
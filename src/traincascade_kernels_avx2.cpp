@@ -0,0 +1,11 @@
+#include "traincascade_kernels.h"
+
+#ifdef __AVX2__
+#define CV_KERNELS_NS cv_kernels_avx2
+#define CV_KERNELS_NAME "AVX2"
+#include "traincascade_kernels_impl.h"
+
+const CvTrainKernels* getTrainKernelsAVX2() { return &cv_kernels_avx2::table; }
+#else
+const CvTrainKernels* getTrainKernelsAVX2() { return 0; }
+#endif
@@ -0,0 +1,11 @@
+#include "traincascade_kernels.h"
+
+#ifdef __AVX512F__
+#define CV_KERNELS_NS cv_kernels_avx512
+#define CV_KERNELS_NAME "AVX512"
+#include "traincascade_kernels_impl.h"
+
+const CvTrainKernels* getTrainKernelsAVX512() { return &cv_kernels_avx512::table; }
+#else
+const CvTrainKernels* getTrainKernelsAVX512() { return 0; }
+#endif
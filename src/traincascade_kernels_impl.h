@@ -0,0 +1,690 @@
+// Kernel bodies shared by traincascade_kernels*.cpp. The including file defines
+// CV_KERNELS_NS and CV_KERNELS_NAME and is compiled with the target instruction
+// set enabled; the code below picks its vector width from the compiler macros.
+// Every variant performs the same arithmetic in the same order, so results do
+// not depend on the selected set.
+
+#include "opencv2/core/core.hpp"
+#include "opencv2/core/internal.hpp"
+#if defined __AVX2__ || defined __AVX512F__
+#  include <immintrin.h>
+#endif
+#include <climits>
+#include <cstring>
+
+#include "traincascade_kernels.h"
+
+namespace CV_KERNELS_NS
+{
+
+// dst = a + b
+static inline void addRow32s( const int* a, const int* b, int* dst, int n )
+{
+    int i = 0;
+#if defined __AVX512F__
+    for( ; i <= n - 16; i += 16 )
+        _mm512_storeu_si512( dst + i, _mm512_add_epi32( _mm512_loadu_si512( a + i ), _mm512_loadu_si512( b + i ) ) );
+#elif defined __AVX2__
+    for( ; i <= n - 8; i += 8 )
+        _mm256_storeu_si256( (__m256i*)(dst + i), _mm256_add_epi32(
+            _mm256_loadu_si256( (const __m256i*)(a + i) ), _mm256_loadu_si256( (const __m256i*)(b + i) ) ) );
+#endif
+#if CV_SSE2
+    for( ; i <= n - 4; i += 4 )
+        _mm_storeu_si128( (__m128i*)(dst + i), _mm_add_epi32(
+            _mm_loadu_si128( (const __m128i*)(a + i) ), _mm_loadu_si128( (const __m128i*)(b + i) ) ) );
+#endif
+    for( ; i < n; i++ )
+        dst[i] = a[i] + b[i];
+}
+
+// dst = a + b + c
+static inline void addRow3_32s( const int* a, const int* b, const int* c, int* dst, int n )
+{
+    int i = 0;
+#if defined __AVX512F__
+    for( ; i <= n - 16; i += 16 )
+        _mm512_storeu_si512( dst + i, _mm512_add_epi32( _mm512_loadu_si512( a + i ),
+            _mm512_add_epi32( _mm512_loadu_si512( b + i ), _mm512_loadu_si512( c + i ) ) ) );
+#elif defined __AVX2__
+    for( ; i <= n - 8; i += 8 )
+        _mm256_storeu_si256( (__m256i*)(dst + i), _mm256_add_epi32( _mm256_loadu_si256( (const __m256i*)(a + i) ),
+            _mm256_add_epi32( _mm256_loadu_si256( (const __m256i*)(b + i) ), _mm256_loadu_si256( (const __m256i*)(c + i) ) ) ) );
+#endif
+#if CV_SSE2
+    for( ; i <= n - 4; i += 4 )
+        _mm_storeu_si128( (__m128i*)(dst + i), _mm_add_epi32( _mm_loadu_si128( (const __m128i*)(a + i) ),
+            _mm_add_epi32( _mm_loadu_si128( (const __m128i*)(b + i) ), _mm_loadu_si128( (const __m128i*)(c + i) ) ) ) );
+#endif
+    for( ; i < n; i++ )
+        dst[i] = a[i] + b[i] + c[i];
+}
+
+// dst = a + b, a widened from bytes
+static inline void addRow8u32s( const uchar* a, const int* b, int* dst, int n )
+{
+    int i = 0;
+#if defined __AVX512F__
+    for( ; i <= n - 16; i += 16 )
+        _mm512_storeu_si512( dst + i, _mm512_add_epi32(
+            _mm512_cvtepu8_epi32( _mm_loadu_si128( (const __m128i*)(a + i) ) ), _mm512_loadu_si512( b + i ) ) );
+#elif defined __AVX2__
+    for( ; i <= n - 8; i += 8 )
+        _mm256_storeu_si256( (__m256i*)(dst + i), _mm256_add_epi32(
+            _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)(a + i) ) ), _mm256_loadu_si256( (const __m256i*)(b + i) ) ) );
+#endif
+#if CV_SSE2
+    __m128i z = _mm_setzero_si128();
+    for( ; i <= n - 4; i += 4 )
+    {
+        __m128i v = _mm_cvtsi32_si128( *(const int*)(a + i) );
+        v = _mm_unpacklo_epi16( _mm_unpacklo_epi8( v, z ), z );
+        _mm_storeu_si128( (__m128i*)(dst + i), _mm_add_epi32( v, _mm_loadu_si128( (const __m128i*)(b + i) ) ) );
+    }
+#endif
+    for( ; i < n; i++ )
+        dst[i] = a[i] + b[i];
+}
+
+// dst += a
+static inline void accRow32f( const float* a, float* dst, int n )
+{
+    int i = 0;
+#if defined __AVX512F__
+    for( ; i <= n - 16; i += 16 )
+        _mm512_storeu_ps( dst + i, _mm512_add_ps( _mm512_loadu_ps( dst + i ), _mm512_loadu_ps( a + i ) ) );
+    if( i < n )
+    {
+        // a short row (the 9 HOG bins) is a single masked operation
+        __mmask16 m = (__mmask16)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_ps( dst + i, m, _mm512_add_ps(
+            _mm512_maskz_loadu_ps( m, dst + i ), _mm512_maskz_loadu_ps( m, a + i ) ) );
+        return;
+    }
+#elif defined __AVX2__
+    for( ; i <= n - 8; i += 8 )
+        _mm256_storeu_ps( dst + i, _mm256_add_ps( _mm256_loadu_ps( dst + i ), _mm256_loadu_ps( a + i ) ) );
+#endif
+#if CV_SSE2
+    for( ; i <= n - 4; i += 4 )
+        _mm_storeu_ps( dst + i, _mm_add_ps( _mm_loadu_ps( dst + i ), _mm_loadu_ps( a + i ) ) );
+#endif
+    for( ; i < n; i++ )
+        dst[i] += a[i];
+}
+
+/*
+ * Integral images of one training window in a single pass over the pixels.
+ * The upright sum is the usual (h+1)x(w+1) int table; the tilted table is built
+ * from the anti-diagonal running sums A(x,y) = I(x,y) + A(x+1,y-1):
+ *   T(x,y) = T(x-1,y-1) + A(x-1,y-1) + A(x-1,y-2),  T(0,y) = T(1,y-1).
+ * Only the sum and squared sum over the normalization rectangle are gathered,
+ * so no full-resolution squared sum plane is written.
+ */
+static float windowIntegrals( const uchar* src, size_t srcstep, int width, int height,
+                              int* sum, int* tilted, size_t step, int* adiag )
+{
+    int* acur = adiag;
+    int* aprev = adiag + width + 1;
+    int64 nsum = 0, nsqsum = 0;
+
+    memset( sum, 0, (width + 1)*sizeof(sum[0]) );
+    if( tilted )
+    {
+        memset( tilted, 0, (width + 1)*sizeof(tilted[0]) );
+        memset( adiag, 0, 2*(width + 1)*sizeof(adiag[0]) );
+    }
+
+    for( int y = 0; y < height; y++, src += srcstep )
+    {
+        const int* prow = sum + y*step;
+        int* row = sum + (y + 1)*step;
+        int s = 0, x;
+
+        row[0] = 0;
+        for( x = 0; x < width; x++ )
+        {
+            s += src[x];
+            row[x + 1] = s;
+        }
+        addRow32s( row + 1, prow + 1, row + 1, width );
+
+        if( y >= 1 && y <= height - 2 )
+        {
+            int rs = 0, rsq = 0;
+            for( x = 1; x <= width - 2; x++ )
+            {
+                int v = src[x];
+                rs += v;
+                rsq += v*v;
+            }
+            nsum += rs;
+            nsqsum += rsq;
+        }
+
+        if( !tilted )
+            continue;
+
+        std::swap( acur, aprev );
+        // acur holds A(.,y-2) at this point and becomes A(.,y); aprev is A(.,y-1)
+        const int* ptrow = tilted + y*step;
+        int* trow = tilted + (y + 1)*step;
+        addRow8u32s( src, aprev + 1, acur, width );
+        acur[width] = 0;
+
+        trow[0] = ptrow[1];
+        addRow3_32s( ptrow, acur, aprev, trow + 1, width );
+    }
+
+    double area = (double)(width - 2)*(height - 2);
+    if( area <= 0 )
+        return 0.f;
+    return (float)sqrt( area*(double)nsqsum - (double)nsum*(double)nsum );
+}
+
+static void hogAccumulateRow( const float* mag, const float* angle, float angleScale,
+                              int width, int nbins, float* rowSum, float* accHist, float* accNorm )
+{
+    for( int b = 0; b < nbins; b++ )
+        rowSum[b] = 0.f;
+    float normRowSum = 0.f;
+
+    for( int x = 0; x < width; x++ )
+    {
+        float m = mag[x];
+        int bidx = cvFloor( angle[x]*angleScale - 0.5f );
+        // wrap the bin index into [0, nbins) without branching
+        bidx += nbins & -(bidx < 0);
+        bidx -= nbins & -(bidx >= nbins);
+
+        rowSum[bidx] += m;
+        normRowSum += m;
+
+        // the integral row above is updated in place: I(y+1, x+1) = I(y, x+1) + rowSum
+        accRow32f( rowSum, accHist + (x + 1)*nbins, nbins );
+        accNorm[x + 1] += normRowSum;
+    }
+}
+
+static inline float haarResponse( const int* row, const int* p, const float* wt, float nf )
+{
+    float ret = wt[0] * (row[p[0]] - row[p[1]] - row[p[2]] + row[p[3]]) +
+        wt[1] * (row[p[4]] - row[p[5]] - row[p[6]] + row[p[7]]);
+    ret += wt[2] * (row[p[8]] - row[p[9]] - row[p[10]] + row[p[11]]);
+    return !nf ? 0.f : ret/nf;
+}
+
+static void haarColumn( const int* img, size_t step, const float* normfactor,
+                        const int* offsets, const float* weights, int n, float* dst )
+{
+    int i = 0;
+#if defined __AVX512F__ || defined __AVX2__
+    int maxOffset = 0;
+    for( int j = 0; j < 12; j++ )
+        maxOffset = std::max( maxOffset, offsets[j] );
+    // gather indices are 32-bit
+    if( n > 0 && (double)(n - 1)*step + maxOffset <= INT_MAX )
+    {
+        int istep = (int)step;
+#  if defined __AVX512F__
+        const __m512i lane = _mm512_mullo_epi32( _mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 ),
+                                                 _mm512_set1_epi32( istep ) );
+        const __m512 zero = _mm512_setzero_ps();
+        __m512 w[3];
+        for( int j = 0; j < 3; j++ )
+            w[j] = _mm512_set1_ps( weights[j] );
+        for( ; i <= n - 16; i += 16 )
+        {
+            __m512i base = _mm512_add_epi32( lane, _mm512_set1_epi32( i*istep ) );
+            __m512 r[3];
+            for( int j = 0; j < 3; j++ )
+            {
+                const int* p = offsets + j*4;
+                __m512i d = _mm512_sub_epi32(
+                    _mm512_i32gather_epi32( _mm512_add_epi32( base, _mm512_set1_epi32( p[0] ) ), img, 4 ),
+                    _mm512_i32gather_epi32( _mm512_add_epi32( base, _mm512_set1_epi32( p[1] ) ), img, 4 ) );
+                d = _mm512_sub_epi32( d, _mm512_i32gather_epi32( _mm512_add_epi32( base, _mm512_set1_epi32( p[2] ) ), img, 4 ) );
+                d = _mm512_add_epi32( d, _mm512_i32gather_epi32( _mm512_add_epi32( base, _mm512_set1_epi32( p[3] ) ), img, 4 ) );
+                r[j] = _mm512_mul_ps( w[j], _mm512_cvtepi32_ps( d ) );
+            }
+            __m512 ret = _mm512_add_ps( _mm512_add_ps( r[0], r[1] ), r[2] );
+            __m512 nf = _mm512_loadu_ps( normfactor + i );
+            __mmask16 valid = _mm512_cmp_ps_mask( nf, zero, _CMP_NEQ_UQ );
+            _mm512_storeu_ps( dst + i, _mm512_maskz_div_ps( valid, ret, nf ) );
+        }
+#  else
+        const __m256i lane = _mm256_mullo_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), _mm256_set1_epi32( istep ) );
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 w[3];
+        for( int j = 0; j < 3; j++ )
+            w[j] = _mm256_set1_ps( weights[j] );
+        for( ; i <= n - 8; i += 8 )
+        {
+            __m256i base = _mm256_add_epi32( lane, _mm256_set1_epi32( i*istep ) );
+            __m256 r[3];
+            for( int j = 0; j < 3; j++ )
+            {
+                const int* p = offsets + j*4;
+                __m256i d = _mm256_sub_epi32(
+                    _mm256_i32gather_epi32( img, _mm256_add_epi32( base, _mm256_set1_epi32( p[0] ) ), 4 ),
+                    _mm256_i32gather_epi32( img, _mm256_add_epi32( base, _mm256_set1_epi32( p[1] ) ), 4 ) );
+                d = _mm256_sub_epi32( d, _mm256_i32gather_epi32( img, _mm256_add_epi32( base, _mm256_set1_epi32( p[2] ) ), 4 ) );
+                d = _mm256_add_epi32( d, _mm256_i32gather_epi32( img, _mm256_add_epi32( base, _mm256_set1_epi32( p[3] ) ), 4 ) );
+                r[j] = _mm256_mul_ps( w[j], _mm256_cvtepi32_ps( d ) );
+            }
+            __m256 ret = _mm256_add_ps( _mm256_add_ps( r[0], r[1] ), r[2] );
+            __m256 nf = _mm256_loadu_ps( normfactor + i );
+            __m256 valid = _mm256_cmp_ps( nf, zero, _CMP_NEQ_UQ );
+            _mm256_storeu_ps( dst + i, _mm256_and_ps( valid, _mm256_div_ps( ret, nf ) ) );
+        }
+#  endif
+    }
+#endif
+    for( ; i < n; i++ )
+        dst[i] = haarResponse( img + i*step, offsets, weights, normfactor[i] );
+}
+
+static inline int lbpCode( const int* row, const int* p )
+{
+    int cval = row[p[5]] - row[p[6]] - row[p[9]] + row[p[10]];
+    return (row[p[0]] - row[p[1]] - row[p[4]] + row[p[5]] >= cval ? 128 : 0) |
+        (row[p[1]] - row[p[2]] - row[p[5]] + row[p[6]] >= cval ? 64 : 0) |
+        (row[p[2]] - row[p[3]] - row[p[6]] + row[p[7]] >= cval ? 32 : 0) |
+        (row[p[6]] - row[p[7]] - row[p[10]] + row[p[11]] >= cval ? 16 : 0) |
+        (row[p[10]] - row[p[11]] - row[p[14]] + row[p[15]] >= cval ? 8 : 0) |
+        (row[p[9]] - row[p[10]] - row[p[13]] + row[p[14]] >= cval ? 4 : 0) |
+        (row[p[8]] - row[p[9]] - row[p[12]] + row[p[13]] >= cval ? 2 : 0) |
+        (row[p[4]] - row[p[5]] - row[p[8]] + row[p[9]] >= cval ? 1 : 0);
+}
+
+// the 8 neighbour cells of the 3x3 LBP block as the top-left points of their 2x2 corners,
+// in the order of the code bits from 128 down to 1
+static const int lbpCells[8] = { 0, 1, 2, 6, 10, 9, 8, 4 };
+
+static void lbpColumn( const int* img, size_t step, const int* offsets, int n, float* dst )
+{
+    int i = 0;
+#if defined __AVX512F__ || defined __AVX2__
+    int maxOffset = 0;
+    for( int j = 0; j < 16; j++ )
+        maxOffset = std::max( maxOffset, offsets[j] );
+    // gather indices are 32-bit
+    if( n > 0 && (double)(n - 1)*step + maxOffset <= INT_MAX )
+    {
+        int istep = (int)step;
+#  if defined __AVX512F__
+        const __m512i lane = _mm512_mullo_epi32( _mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 ),
+                                                 _mm512_set1_epi32( istep ) );
+        for( ; i <= n - 16; i += 16 )
+        {
+            __m512i base = _mm512_add_epi32( lane, _mm512_set1_epi32( i*istep ) );
+            __m512i v[16];
+            for( int j = 0; j < 16; j++ )
+                v[j] = _mm512_i32gather_epi32( _mm512_add_epi32( base, _mm512_set1_epi32( offsets[j] ) ), img, 4 );
+            __m512i cval = _mm512_add_epi32( _mm512_sub_epi32( _mm512_sub_epi32( v[5], v[6] ), v[9] ), v[10] );
+            __m512i code = _mm512_setzero_si512();
+            for( int b = 0; b < 8; b++ )
+            {
+                int c = lbpCells[b];
+                __m512i s = _mm512_add_epi32( _mm512_sub_epi32( _mm512_sub_epi32( v[c], v[c + 1] ), v[c + 4] ), v[c + 5] );
+                code = _mm512_mask_or_epi32( code, _mm512_cmpge_epi32_mask( s, cval ), code,
+                                             _mm512_set1_epi32( 128 >> b ) );
+            }
+            _mm512_storeu_ps( dst + i, _mm512_cvtepi32_ps( code ) );
+        }
+#  else
+        const __m256i lane = _mm256_mullo_epi32( _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ), _mm256_set1_epi32( istep ) );
+        for( ; i <= n - 8; i += 8 )
+        {
+            __m256i base = _mm256_add_epi32( lane, _mm256_set1_epi32( i*istep ) );
+            __m256i v[16];
+            for( int j = 0; j < 16; j++ )
+                v[j] = _mm256_i32gather_epi32( img, _mm256_add_epi32( base, _mm256_set1_epi32( offsets[j] ) ), 4 );
+            __m256i cval = _mm256_add_epi32( _mm256_sub_epi32( _mm256_sub_epi32( v[5], v[6] ), v[9] ), v[10] );
+            __m256i code = _mm256_setzero_si256();
+            for( int b = 0; b < 8; b++ )
+            {
+                int c = lbpCells[b];
+                __m256i s = _mm256_add_epi32( _mm256_sub_epi32( _mm256_sub_epi32( v[c], v[c + 1] ), v[c + 4] ), v[c + 5] );
+                // s >= cval is !(cval > s)
+                code = _mm256_or_si256( code, _mm256_andnot_si256( _mm256_cmpgt_epi32( cval, s ),
+                                                                    _mm256_set1_epi32( 128 >> b ) ) );
+            }
+            _mm256_storeu_ps( dst + i, _mm256_cvtepi32_ps( code ) );
+        }
+#  endif
+    }
+#endif
+    for( ; i < n; i++ )
+        dst[i] = (float)lbpCode( img + i*step, offsets );
+}
+
+static void hogColumn( const float* hist, size_t histStep, const float* norm, size_t normStep,
+                       const int* offsets, int n, float* dst )
+{
+    int i = 0;
+#if defined __AVX512F__ || defined __AVX2__
+    int maxOffset = std::max( std::max( offsets[0], offsets[1] ), std::max( offsets[2], offsets[3] ) );
+    // gather indices are 32-bit
+    if( n > 0 && (double)(n - 1)*std::max( histStep, normStep ) + maxOffset <= INT_MAX )
+    {
+        int hstep = (int)histStep, nstep = (int)normStep;
+#  if defined __AVX512F__
+        const __m512i idx = _mm512_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 );
+        const __m512i hlane = _mm512_mullo_epi32( idx, _mm512_set1_epi32( hstep ) );
+        const __m512i nlane = _mm512_mullo_epi32( idx, _mm512_set1_epi32( nstep ) );
+        const __m512 minVal = _mm512_set1_ps( 0.001f );
+        for( ; i <= n - 16; i += 16 )
+        {
+            __m512i base = _mm512_add_epi32( hlane, _mm512_set1_epi32( i*hstep ) );
+            __m512 v[4];
+            for( int j = 0; j < 4; j++ )
+                v[j] = _mm512_i32gather_ps( _mm512_add_epi32( base, _mm512_set1_epi32( offsets[j] ) ), hist, 4 );
+            __m512 res = _mm512_add_ps( _mm512_sub_ps( _mm512_sub_ps( v[0], v[1] ), v[2] ), v[3] );
+            __m512 nf = _mm512_i32gather_ps( _mm512_add_epi32( nlane, _mm512_set1_epi32( i*nstep ) ), norm, 4 );
+            __mmask16 valid = _mm512_cmp_ps_mask( res, minVal, _CMP_GT_OQ );
+            _mm512_storeu_ps( dst + i, _mm512_maskz_div_ps( valid, res, _mm512_add_ps( nf, minVal ) ) );
+        }
+#  else
+        const __m256i idx = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+        const __m256i hlane = _mm256_mullo_epi32( idx, _mm256_set1_epi32( hstep ) );
+        const __m256i nlane = _mm256_mullo_epi32( idx, _mm256_set1_epi32( nstep ) );
+        const __m256 minVal = _mm256_set1_ps( 0.001f );
+        for( ; i <= n - 8; i += 8 )
+        {
+            __m256i base = _mm256_add_epi32( hlane, _mm256_set1_epi32( i*hstep ) );
+            __m256 v[4];
+            for( int j = 0; j < 4; j++ )
+                v[j] = _mm256_i32gather_ps( hist, _mm256_add_epi32( base, _mm256_set1_epi32( offsets[j] ) ), 4 );
+            __m256 res = _mm256_add_ps( _mm256_sub_ps( _mm256_sub_ps( v[0], v[1] ), v[2] ), v[3] );
+            __m256 nf = _mm256_i32gather_ps( norm, _mm256_add_epi32( nlane, _mm256_set1_epi32( i*nstep ) ), 4 );
+            __m256 valid = _mm256_cmp_ps( res, minVal, _CMP_GT_OQ );
+            _mm256_storeu_ps( dst + i, _mm256_and_ps( valid, _mm256_div_ps( res, _mm256_add_ps( nf, minVal ) ) ) );
+        }
+#  endif
+    }
+#endif
+    for( ; i < n; i++ )
+    {
+        const float* h = hist + i*histStep;
+        float res = h[offsets[0]] - h[offsets[1]] - h[offsets[2]] + h[offsets[3]];
+        dst[i] = res > 0.001f ? res/(norm[i*normStep] + 0.001f) : 0.f;
+    }
+}
+
+#if defined __AVX2__
+static inline int popCount16( unsigned m )
+{
+    m = m - ((m >> 1) & 0x5555);
+    m = (m & 0x3333) + ((m >> 2) & 0x3333);
+    m = (m + (m >> 4)) & 0x0f0f;
+    return (int)((m + (m >> 8)) & 0x1f);
+}
+#endif
+
+#if defined __AVX2__ && !defined __AVX512F__
+// lane permutations moving the lanes selected by an 8 bit mask to the front,
+// AVX2 has no compress instruction; a constant so that nothing runs at startup
+// before the CPU is checked
+static const int compressTable[256][8] =
+{
+    {0,0,0,0,0,0,0,0}, {0,0,0,0,0,0,0,0}, {1,0,0,0,0,0,0,0}, {0,1,0,0,0,0,0,0},
+    {2,0,0,0,0,0,0,0}, {0,2,0,0,0,0,0,0}, {1,2,0,0,0,0,0,0}, {0,1,2,0,0,0,0,0},
+    {3,0,0,0,0,0,0,0}, {0,3,0,0,0,0,0,0}, {1,3,0,0,0,0,0,0}, {0,1,3,0,0,0,0,0},
+    {2,3,0,0,0,0,0,0}, {0,2,3,0,0,0,0,0}, {1,2,3,0,0,0,0,0}, {0,1,2,3,0,0,0,0},
+    {4,0,0,0,0,0,0,0}, {0,4,0,0,0,0,0,0}, {1,4,0,0,0,0,0,0}, {0,1,4,0,0,0,0,0},
+    {2,4,0,0,0,0,0,0}, {0,2,4,0,0,0,0,0}, {1,2,4,0,0,0,0,0}, {0,1,2,4,0,0,0,0},
+    {3,4,0,0,0,0,0,0}, {0,3,4,0,0,0,0,0}, {1,3,4,0,0,0,0,0}, {0,1,3,4,0,0,0,0},
+    {2,3,4,0,0,0,0,0}, {0,2,3,4,0,0,0,0}, {1,2,3,4,0,0,0,0}, {0,1,2,3,4,0,0,0},
+    {5,0,0,0,0,0,0,0}, {0,5,0,0,0,0,0,0}, {1,5,0,0,0,0,0,0}, {0,1,5,0,0,0,0,0},
+    {2,5,0,0,0,0,0,0}, {0,2,5,0,0,0,0,0}, {1,2,5,0,0,0,0,0}, {0,1,2,5,0,0,0,0},
+    {3,5,0,0,0,0,0,0}, {0,3,5,0,0,0,0,0}, {1,3,5,0,0,0,0,0}, {0,1,3,5,0,0,0,0},
+    {2,3,5,0,0,0,0,0}, {0,2,3,5,0,0,0,0}, {1,2,3,5,0,0,0,0}, {0,1,2,3,5,0,0,0},
+    {4,5,0,0,0,0,0,0}, {0,4,5,0,0,0,0,0}, {1,4,5,0,0,0,0,0}, {0,1,4,5,0,0,0,0},
+    {2,4,5,0,0,0,0,0}, {0,2,4,5,0,0,0,0}, {1,2,4,5,0,0,0,0}, {0,1,2,4,5,0,0,0},
+    {3,4,5,0,0,0,0,0}, {0,3,4,5,0,0,0,0}, {1,3,4,5,0,0,0,0}, {0,1,3,4,5,0,0,0},
+    {2,3,4,5,0,0,0,0}, {0,2,3,4,5,0,0,0}, {1,2,3,4,5,0,0,0}, {0,1,2,3,4,5,0,0},
+    {6,0,0,0,0,0,0,0}, {0,6,0,0,0,0,0,0}, {1,6,0,0,0,0,0,0}, {0,1,6,0,0,0,0,0},
+    {2,6,0,0,0,0,0,0}, {0,2,6,0,0,0,0,0}, {1,2,6,0,0,0,0,0}, {0,1,2,6,0,0,0,0},
+    {3,6,0,0,0,0,0,0}, {0,3,6,0,0,0,0,0}, {1,3,6,0,0,0,0,0}, {0,1,3,6,0,0,0,0},
+    {2,3,6,0,0,0,0,0}, {0,2,3,6,0,0,0,0}, {1,2,3,6,0,0,0,0}, {0,1,2,3,6,0,0,0},
+    {4,6,0,0,0,0,0,0}, {0,4,6,0,0,0,0,0}, {1,4,6,0,0,0,0,0}, {0,1,4,6,0,0,0,0},
+    {2,4,6,0,0,0,0,0}, {0,2,4,6,0,0,0,0}, {1,2,4,6,0,0,0,0}, {0,1,2,4,6,0,0,0},
+    {3,4,6,0,0,0,0,0}, {0,3,4,6,0,0,0,0}, {1,3,4,6,0,0,0,0}, {0,1,3,4,6,0,0,0},
+    {2,3,4,6,0,0,0,0}, {0,2,3,4,6,0,0,0}, {1,2,3,4,6,0,0,0}, {0,1,2,3,4,6,0,0},
+    {5,6,0,0,0,0,0,0}, {0,5,6,0,0,0,0,0}, {1,5,6,0,0,0,0,0}, {0,1,5,6,0,0,0,0},
+    {2,5,6,0,0,0,0,0}, {0,2,5,6,0,0,0,0}, {1,2,5,6,0,0,0,0}, {0,1,2,5,6,0,0,0},
+    {3,5,6,0,0,0,0,0}, {0,3,5,6,0,0,0,0}, {1,3,5,6,0,0,0,0}, {0,1,3,5,6,0,0,0},
+    {2,3,5,6,0,0,0,0}, {0,2,3,5,6,0,0,0}, {1,2,3,5,6,0,0,0}, {0,1,2,3,5,6,0,0},
+    {4,5,6,0,0,0,0,0}, {0,4,5,6,0,0,0,0}, {1,4,5,6,0,0,0,0}, {0,1,4,5,6,0,0,0},
+    {2,4,5,6,0,0,0,0}, {0,2,4,5,6,0,0,0}, {1,2,4,5,6,0,0,0}, {0,1,2,4,5,6,0,0},
+    {3,4,5,6,0,0,0,0}, {0,3,4,5,6,0,0,0}, {1,3,4,5,6,0,0,0}, {0,1,3,4,5,6,0,0},
+    {2,3,4,5,6,0,0,0}, {0,2,3,4,5,6,0,0}, {1,2,3,4,5,6,0,0}, {0,1,2,3,4,5,6,0},
+    {7,0,0,0,0,0,0,0}, {0,7,0,0,0,0,0,0}, {1,7,0,0,0,0,0,0}, {0,1,7,0,0,0,0,0},
+    {2,7,0,0,0,0,0,0}, {0,2,7,0,0,0,0,0}, {1,2,7,0,0,0,0,0}, {0,1,2,7,0,0,0,0},
+    {3,7,0,0,0,0,0,0}, {0,3,7,0,0,0,0,0}, {1,3,7,0,0,0,0,0}, {0,1,3,7,0,0,0,0},
+    {2,3,7,0,0,0,0,0}, {0,2,3,7,0,0,0,0}, {1,2,3,7,0,0,0,0}, {0,1,2,3,7,0,0,0},
+    {4,7,0,0,0,0,0,0}, {0,4,7,0,0,0,0,0}, {1,4,7,0,0,0,0,0}, {0,1,4,7,0,0,0,0},
+    {2,4,7,0,0,0,0,0}, {0,2,4,7,0,0,0,0}, {1,2,4,7,0,0,0,0}, {0,1,2,4,7,0,0,0},
+    {3,4,7,0,0,0,0,0}, {0,3,4,7,0,0,0,0}, {1,3,4,7,0,0,0,0}, {0,1,3,4,7,0,0,0},
+    {2,3,4,7,0,0,0,0}, {0,2,3,4,7,0,0,0}, {1,2,3,4,7,0,0,0}, {0,1,2,3,4,7,0,0},
+    {5,7,0,0,0,0,0,0}, {0,5,7,0,0,0,0,0}, {1,5,7,0,0,0,0,0}, {0,1,5,7,0,0,0,0},
+    {2,5,7,0,0,0,0,0}, {0,2,5,7,0,0,0,0}, {1,2,5,7,0,0,0,0}, {0,1,2,5,7,0,0,0},
+    {3,5,7,0,0,0,0,0}, {0,3,5,7,0,0,0,0}, {1,3,5,7,0,0,0,0}, {0,1,3,5,7,0,0,0},
+    {2,3,5,7,0,0,0,0}, {0,2,3,5,7,0,0,0}, {1,2,3,5,7,0,0,0}, {0,1,2,3,5,7,0,0},
+    {4,5,7,0,0,0,0,0}, {0,4,5,7,0,0,0,0}, {1,4,5,7,0,0,0,0}, {0,1,4,5,7,0,0,0},
+    {2,4,5,7,0,0,0,0}, {0,2,4,5,7,0,0,0}, {1,2,4,5,7,0,0,0}, {0,1,2,4,5,7,0,0},
+    {3,4,5,7,0,0,0,0}, {0,3,4,5,7,0,0,0}, {1,3,4,5,7,0,0,0}, {0,1,3,4,5,7,0,0},
+    {2,3,4,5,7,0,0,0}, {0,2,3,4,5,7,0,0}, {1,2,3,4,5,7,0,0}, {0,1,2,3,4,5,7,0},
+    {6,7,0,0,0,0,0,0}, {0,6,7,0,0,0,0,0}, {1,6,7,0,0,0,0,0}, {0,1,6,7,0,0,0,0},
+    {2,6,7,0,0,0,0,0}, {0,2,6,7,0,0,0,0}, {1,2,6,7,0,0,0,0}, {0,1,2,6,7,0,0,0},
+    {3,6,7,0,0,0,0,0}, {0,3,6,7,0,0,0,0}, {1,3,6,7,0,0,0,0}, {0,1,3,6,7,0,0,0},
+    {2,3,6,7,0,0,0,0}, {0,2,3,6,7,0,0,0}, {1,2,3,6,7,0,0,0}, {0,1,2,3,6,7,0,0},
+    {4,6,7,0,0,0,0,0}, {0,4,6,7,0,0,0,0}, {1,4,6,7,0,0,0,0}, {0,1,4,6,7,0,0,0},
+    {2,4,6,7,0,0,0,0}, {0,2,4,6,7,0,0,0}, {1,2,4,6,7,0,0,0}, {0,1,2,4,6,7,0,0},
+    {3,4,6,7,0,0,0,0}, {0,3,4,6,7,0,0,0}, {1,3,4,6,7,0,0,0}, {0,1,3,4,6,7,0,0},
+    {2,3,4,6,7,0,0,0}, {0,2,3,4,6,7,0,0}, {1,2,3,4,6,7,0,0}, {0,1,2,3,4,6,7,0},
+    {5,6,7,0,0,0,0,0}, {0,5,6,7,0,0,0,0}, {1,5,6,7,0,0,0,0}, {0,1,5,6,7,0,0,0},
+    {2,5,6,7,0,0,0,0}, {0,2,5,6,7,0,0,0}, {1,2,5,6,7,0,0,0}, {0,1,2,5,6,7,0,0},
+    {3,5,6,7,0,0,0,0}, {0,3,5,6,7,0,0,0}, {1,3,5,6,7,0,0,0}, {0,1,3,5,6,7,0,0},
+    {2,3,5,6,7,0,0,0}, {0,2,3,5,6,7,0,0}, {1,2,3,5,6,7,0,0}, {0,1,2,3,5,6,7,0},
+    {4,5,6,7,0,0,0,0}, {0,4,5,6,7,0,0,0}, {1,4,5,6,7,0,0,0}, {0,1,4,5,6,7,0,0},
+    {2,4,5,6,7,0,0,0}, {0,2,4,5,6,7,0,0}, {1,2,4,5,6,7,0,0}, {0,1,2,4,5,6,7,0},
+    {3,4,5,6,7,0,0,0}, {0,3,4,5,6,7,0,0}, {1,3,4,5,6,7,0,0}, {0,1,3,4,5,6,7,0},
+    {2,3,4,5,6,7,0,0}, {0,2,3,4,5,6,7,0}, {1,2,3,4,5,6,7,0}, {0,1,2,3,4,5,6,7}
+};
+
+// stores the lanes of v selected by m to dst, nothing is written past them
+static inline int compressStore8( int* dst, __m256i v, int m )
+{
+    int k = popCount16( m );
+    __m256i perm = _mm256_loadu_si256( (const __m256i*)compressTable[m] );
+    __m256i lanes = _mm256_cmpgt_epi32( _mm256_set1_epi32( k ), _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ) );
+    _mm256_maskstore_epi32( dst, lanes, _mm256_permutevar8x32_epi32( v, perm ) );
+    return k;
+}
+
+// compressStore8 for 16 bit destinations: the lanes are compressed in 32 bits, narrowed,
+// and only the selected ones are copied out
+static inline int compressStore8( ushort* dst, __m256i v, int m )
+{
+    int k = popCount16( m );
+    __m256i perm = _mm256_loadu_si256( (const __m256i*)compressTable[m] );
+    __m256i packed = _mm256_packus_epi32( _mm256_permutevar8x32_epi32( v, perm ), _mm256_setzero_si256() );
+    // packus works within the 128 bit halves, quadwords 0 and 2 hold lanes 0-3 and 4-7
+    ushort buf[8];
+    _mm_storeu_si128( (__m128i*)buf, _mm256_castsi256_si128( _mm256_permute4x64_epi64( packed, 0x08 ) ) );
+    memcpy( dst, buf, k*sizeof(ushort) );
+    return k;
+}
+#endif
+
+static void partitionSorted32s( const int* src, const int* table, int n, int* ldst, int* rdst )
+{
+    int i = 0;
+#if defined __AVX512F__
+    const __m512i low = _mm512_set1_epi32( INT_MAX );
+    const __m512i zero = _mm512_setzero_si512();
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m512i v = _mm512_i32gather_epi32( _mm512_loadu_si512( src + i ), table, 4 );
+        __mmask16 right = _mm512_cmplt_epi32_mask( v, zero );
+        v = _mm512_and_si512( v, low );
+        _mm512_mask_compressstoreu_epi32( ldst, (__mmask16)~right, v );
+        _mm512_mask_compressstoreu_epi32( rdst, right, v );
+        int nr = popCount16( right );
+        rdst += nr;
+        ldst += 16 - nr;
+    }
+#elif defined __AVX2__
+    const __m256i low = _mm256_set1_epi32( INT_MAX );
+    for( ; i <= n - 8; i += 8 )
+    {
+        __m256i v = _mm256_i32gather_epi32( table, _mm256_loadu_si256( (const __m256i*)(src + i) ), 4 );
+        int right = _mm256_movemask_ps( _mm256_castsi256_ps( v ) );
+        v = _mm256_and_si256( v, low );
+        ldst += compressStore8( ldst, v, right ^ 255 );
+        rdst += compressStore8( rdst, v, right );
+    }
+#endif
+    for( ; i < n; i++ )
+    {
+        int v = table[src[i]];
+        int d = (int)((unsigned)v >> 31);
+        // one store through the selected pointer, no branch on the direction
+        *(d ? rdst : ldst) = v & INT_MAX;
+        rdst += d;
+        ldst += d ^ 1;
+    }
+}
+
+static void partitionSorted16u( const int* src, const int* table, int n, ushort* ldst, ushort* rdst )
+{
+    int i = 0;
+#if defined __AVX512F__
+    // compressed in 32 bit lanes, narrowed by the masked store
+    const __m512i low = _mm512_set1_epi32( INT_MAX );
+    const __m512i zero = _mm512_setzero_si512();
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m512i v = _mm512_i32gather_epi32( _mm512_loadu_si512( src + i ), table, 4 );
+        __mmask16 right = _mm512_cmplt_epi32_mask( v, zero );
+        v = _mm512_and_si512( v, low );
+        int nr = popCount16( right ), nl = 16 - nr;
+        _mm512_mask_cvtepi32_storeu_epi16( ldst, (__mmask16)((1u << nl) - 1),
+                                           _mm512_maskz_compress_epi32( (__mmask16)~right, v ) );
+        _mm512_mask_cvtepi32_storeu_epi16( rdst, (__mmask16)((1u << nr) - 1),
+                                           _mm512_maskz_compress_epi32( right, v ) );
+        rdst += nr;
+        ldst += nl;
+    }
+#elif defined __AVX2__
+    const __m256i low = _mm256_set1_epi32( INT_MAX );
+    for( ; i <= n - 8; i += 8 )
+    {
+        __m256i v = _mm256_i32gather_epi32( table, _mm256_loadu_si256( (const __m256i*)(src + i) ), 4 );
+        int right = _mm256_movemask_ps( _mm256_castsi256_ps( v ) );
+        v = _mm256_and_si256( v, low );
+        ldst += compressStore8( ldst, v, right ^ 255 );
+        rdst += compressStore8( rdst, v, right );
+    }
+#endif
+    for( ; i < n; i++ )
+    {
+        int v = table[src[i]];
+        int d = (int)((unsigned)v >> 31);
+        *(d ? rdst : ldst) = (ushort)(v & INT_MAX);
+        rdst += d;
+        ldst += d ^ 1;
+    }
+}
+
+static void partition32s( const int* src, const char* dir, int n, int* ldst, int* rdst )
+{
+    int i = 0;
+#if defined __AVX512F__
+    const __m512i zero = _mm512_setzero_si512();
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m512i d = _mm512_cvtepi8_epi32( _mm_loadu_si128( (const __m128i*)(dir + i) ) );
+        __mmask16 right = _mm512_cmpneq_epi32_mask( d, zero );
+        __m512i v = _mm512_loadu_si512( src + i );
+        _mm512_mask_compressstoreu_epi32( ldst, (__mmask16)~right, v );
+        _mm512_mask_compressstoreu_epi32( rdst, right, v );
+        int nr = popCount16( right );
+        rdst += nr;
+        ldst += 16 - nr;
+    }
+#elif defined __AVX2__
+    const __m256i zero = _mm256_setzero_si256();
+    for( ; i <= n - 8; i += 8 )
+    {
+        __m256i d = _mm256_cvtepi8_epi32( _mm_loadl_epi64( (const __m128i*)(dir + i) ) );
+        int left = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( d, zero ) ) );
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(src + i) );
+        ldst += compressStore8( ldst, v, left );
+        rdst += compressStore8( rdst, v, left ^ 255 );
+    }
+#endif
+    for( ; i < n; i++ )
+    {
+        int d = dir[i] != 0;
+        *(d ? rdst : ldst) = src[i];
+        rdst += d;
+        ldst += d ^ 1;
+    }
+}
+
+static void partition16u( const int* src, const char* dir, int n, ushort* ldst, ushort* rdst )
+{
+    int i = 0;
+#if defined __AVX512F__
+    const __m512i zero = _mm512_setzero_si512();
+    for( ; i <= n - 16; i += 16 )
+    {
+        __m512i d = _mm512_cvtepi8_epi32( _mm_loadu_si128( (const __m128i*)(dir + i) ) );
+        __mmask16 right = _mm512_cmpneq_epi32_mask( d, zero );
+        __m512i v = _mm512_loadu_si512( src + i );
+        int nr = popCount16( right ), nl = 16 - nr;
+        _mm512_mask_cvtepi32_storeu_epi16( ldst, (__mmask16)((1u << nl) - 1),
+                                           _mm512_maskz_compress_epi32( (__mmask16)~right, v ) );
+        _mm512_mask_cvtepi32_storeu_epi16( rdst, (__mmask16)((1u << nr) - 1),
+                                           _mm512_maskz_compress_epi32( right, v ) );
+        rdst += nr;
+        ldst += nl;
+    }
+#elif defined __AVX2__
+    const __m256i zero = _mm256_setzero_si256();
+    for( ; i <= n - 8; i += 8 )
+    {
+        __m256i d = _mm256_cvtepi8_epi32( _mm_loadl_epi64( (const __m128i*)(dir + i) ) );
+        int left = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32( d, zero ) ) );
+        __m256i v = _mm256_loadu_si256( (const __m256i*)(src + i) );
+        ldst += compressStore8( ldst, v, left );
+        rdst += compressStore8( rdst, v, left ^ 255 );
+    }
+#endif
+    for( ; i < n; i++ )
+    {
+        int d = dir[i] != 0;
+        *(d ? rdst : ldst) = (ushort)src[i];
+        rdst += d;
+        ldst += d ^ 1;
+    }
+}
+
+static const CvTrainKernels table =
+{
+    CV_KERNELS_NAME,
+    windowIntegrals,
+    hogAccumulateRow,
+    haarColumn,
+    lbpColumn,
+    hogColumn,
+    partitionSorted32s,
+    partitionSorted16u,
+    partition32s,
+    partition16u
+};
+
+}